@@ -0,0 +1,294 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Controller map: binds 7-bit & 14-bit controllers, NRPNs and pitch bend of
+/// each midi channel to actions.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <soundtouch/STTypes.h>
+
+#include "ControllerMap.h"
+
+using namespace std;
+
+// controller numbers of NRPN & RPN select and data entry
+#define CC_DATA_MSB 6
+#define CC_DATA_LSB 38
+#define CC_NRPN_LSB 98
+#define CC_NRPN_MSB 99
+#define CC_RPN_LSB 100
+#define CC_RPN_MSB 101
+
+#define MAX_14BIT 16383
+
+
+static void set_slot(controller_map *m, int channel, int cc, int action, ctl_kind kind)
+{
+  for (int c = 0; c < CTL_CHANNELS; c++){
+    if ((channel == CTL_ANY_CHANNEL) || (channel == c)){
+      m->cc[c][cc].action = (unsigned char)action;
+      m->cc[c][cc].kind = (unsigned char)kind;
+    }
+  }
+}
+
+void ctlmap_clear(controller_map *m)
+{
+  memset(m->cc, 0, sizeof(m->cc));
+  m->nrpns.clear();
+  set_slot(m, CTL_ANY_CHANNEL, CC_NRPN_MSB, CTL_NO_ACTION, CTL_NRPN_MSB);
+  set_slot(m, CTL_ANY_CHANNEL, CC_NRPN_LSB, CTL_NO_ACTION, CTL_NRPN_LSB);
+  set_slot(m, CTL_ANY_CHANNEL, CC_DATA_MSB, CTL_NO_ACTION, CTL_DATA_MSB);
+  set_slot(m, CTL_ANY_CHANNEL, CC_DATA_LSB, CTL_NO_ACTION, CTL_DATA_LSB);
+  set_slot(m, CTL_ANY_CHANNEL, CC_RPN_MSB, CTL_NO_ACTION, CTL_RPN);
+  set_slot(m, CTL_ANY_CHANNEL, CC_RPN_LSB, CTL_NO_ACTION, CTL_RPN);
+
+  for (int c = 0; c < CTL_CHANNELS; c++){
+    m->bend[c] = CTL_NO_ACTION;
+    memset(m->state[c].msb, 0, sizeof(m->state[c].msb));
+    m->state[c].nrpn = -1;
+    m->state[c].nrpn_action = CTL_NO_ACTION;
+    m->state[c].data_msb = 0;
+  }
+}
+
+void ctlmap_bind_cc(controller_map *m, int channel, int cc, int action, bool fine)
+{
+  if (fine){
+    set_slot(m, channel, cc, action, CTL_MSB);
+    set_slot(m, channel, cc + 32, action, CTL_LSB);
+  } else {
+    set_slot(m, channel, cc, action, CTL_7BIT);
+  }
+}
+
+void ctlmap_bind_nrpn(controller_map *m, int channel, int number, int action)
+{
+  nrpn_binding b = {channel, number, action};
+  m->nrpns.push_back(b);
+}
+
+void ctlmap_bind_bend(controller_map *m, int channel, int action)
+{
+  for (int c = 0; c < CTL_CHANNELS; c++){
+    if ((channel == CTL_ANY_CHANNEL) || (channel == c)){
+      m->bend[c] = action;
+    }
+  }
+}
+
+// action of an NRPN, a binding of the channel itself wins over one of all channels
+static int find_nrpn(const controller_map *m, int channel, int number)
+{
+  int action = CTL_NO_ACTION;
+  for (size_t i = 0; i < m->nrpns.size(); i++){
+    const nrpn_binding *b = &m->nrpns[i];
+    if (b->number != number){
+      continue;
+    }
+    if (b->channel == channel){
+      return b->action;
+    }
+    if (b->channel == CTL_ANY_CHANNEL){
+      action = b->action;
+    }
+  }
+  return action;
+}
+
+static void throw_map_error(const char *path, int line, const char *what)
+{
+  char msg[512];
+  snprintf(msg, sizeof(msg), "Controller map %s:%d: %s", path, line, what);
+  ST_THROW_RT_ERROR(msg);
+}
+
+// parses a number of 'min'..'max' in decimal or 0x hex, -1 if it isn't one
+static int parse_number(const char *s, int min, int max)
+{
+  char *end;
+  long n = strtol(s, &end, 0);
+  if ((*s == 0) || (*end != 0) || (n < min) || (n > max)){
+    return -1;
+  }
+  return (int)n;
+}
+
+void ctlmap_load(controller_map *m, const char *path, const char * const *names, int num_names)
+{
+  FILE *f = fopen(path, "r");
+  if (f == NULL){
+    throw_map_error(path, 0, "could not open file");
+  }
+
+  ctlmap_clear(m);
+
+  char buf[256];
+  int line = 0;
+  while (fgets(buf, sizeof(buf), f) != NULL){
+    line++;
+    char *comment = strchr(buf, '#');
+    if (comment != NULL){
+      *comment = 0;
+    }
+
+    char *tok[5];
+    int n = 0;
+    for (char *t = strtok(buf, " \t\r\n"); t != NULL; t = strtok(NULL, " \t\r\n")){
+      if (n == 5){
+        break;
+      }
+      tok[n++] = t;
+    }
+    if (n == 0){
+      continue;
+    }
+
+    bool is_bend = (strcmp(tok[0], "bend") == 0);
+    if (n != (is_bend ? 3 : 4)){
+      fclose(f);
+      throw_map_error(path, line, "expected <type> <channel> [number] <action>");
+    }
+
+    int channel = CTL_ANY_CHANNEL;
+    if (strcmp(tok[1], "*") != 0){
+      channel = parse_number(tok[1], 1, CTL_CHANNELS) - 1;
+      if (channel < 0){
+        fclose(f);
+        throw_map_error(path, line, "channel is not 1..16 or *");
+      }
+    }
+
+    const char *name = tok[n - 1];
+    int action = CTL_NO_ACTION;
+    for (int i = 0; i < num_names; i++){
+      if ((names[i] != NULL) && (strcmp(names[i], name) == 0)){
+        action = i;
+        break;
+      }
+    }
+    if (action == CTL_NO_ACTION){
+      fclose(f);
+      throw_map_error(path, line, (string("unknown action ") + name).c_str());
+    }
+
+    if (is_bend){
+      ctlmap_bind_bend(m, channel, action);
+      continue;
+    }
+
+    int number;
+    if (strcmp(tok[0], "cc") == 0){
+      number = parse_number(tok[2], 0, 127);
+    } else if (strcmp(tok[0], "cc14") == 0){
+      number = parse_number(tok[2], 0, 31);
+    } else if (strcmp(tok[0], "nrpn") == 0){
+      number = parse_number(tok[2], 0, MAX_14BIT);
+    } else {
+      fclose(f);
+      throw_map_error(path, line, "type is not cc, cc14, nrpn or bend");
+    }
+    if (number < 0){
+      fclose(f);
+      throw_map_error(path, line, "controller number out of range");
+    }
+
+    if (tok[0][0] == 'n'){
+      ctlmap_bind_nrpn(m, channel, number, action);
+    } else {
+      ctlmap_bind_cc(m, channel, number, action, (tok[0][2] == '1'));
+    }
+  }
+  fclose(f);
+}
+
+static bool decoded(int action, int value, int max, ctl_value *out)
+{
+  out->action = action;
+  out->value = value;
+  out->max = max;
+  return (action != CTL_NO_ACTION);
+}
+
+bool ctlmap_control(controller_map *m, int channel, int cc, int value, ctl_value *out)
+{
+  if ((channel < 0) || (channel >= CTL_CHANNELS) || (cc < 0) || (cc > 127)){
+    return false;
+  }
+  const ctl_slot *slot = &m->cc[channel][cc];
+  ctl_channel *st = &m->state[channel];
+  value &= 0x7f;
+
+  switch (slot->kind){
+    case CTL_7BIT:
+      return decoded(slot->action, value, 127, out);
+    case CTL_MSB:
+      // a new coarse value resets the fine half
+      st->msb[cc] = (unsigned char)value;
+      return decoded(slot->action, value << 7, MAX_14BIT, out);
+    case CTL_LSB:
+      return decoded(slot->action, (st->msb[cc - 32] << 7) | value, MAX_14BIT, out);
+    case CTL_NRPN_MSB:
+      st->nrpn = (value << 7) | ((st->nrpn < 0) ? 0 : (st->nrpn & 0x7f));
+      st->nrpn_action = find_nrpn(m, channel, st->nrpn);
+      return false;
+    case CTL_NRPN_LSB:
+      st->nrpn = ((st->nrpn < 0) ? 0 : (st->nrpn & ~0x7f)) | value;
+      st->nrpn_action = find_nrpn(m, channel, st->nrpn);
+      return false;
+    case CTL_RPN:
+      st->nrpn = -1;
+      st->nrpn_action = CTL_NO_ACTION;
+      return false;
+    case CTL_DATA_MSB:
+      st->data_msb = value;
+      return decoded(st->nrpn_action, value << 7, MAX_14BIT, out);
+    case CTL_DATA_LSB:
+      return decoded(st->nrpn_action, (st->data_msb << 7) | value, MAX_14BIT, out);
+  }
+  return false;
+}
+
+bool ctlmap_control14(controller_map *m, int channel, int cc, int value, ctl_value *out)
+{
+  if ((channel < 0) || (channel >= CTL_CHANNELS) || (cc < 0) || (cc > 127)){
+    return false;
+  }
+  const ctl_slot *slot = &m->cc[channel][cc];
+  value &= MAX_14BIT;
+
+  if (slot->kind == CTL_MSB){
+    m->state[channel].msb[cc] = (unsigned char)(value >> 7);
+    return decoded(slot->action, value, MAX_14BIT, out);
+  }
+  if (slot->kind == CTL_7BIT){
+    return decoded(slot->action, value >> 7, 127, out);
+  }
+  return false;
+}
+
+bool ctlmap_nrpn(controller_map *m, int channel, int number, int value, ctl_value *out)
+{
+  if ((channel < 0) || (channel >= CTL_CHANNELS)){
+    return false;
+  }
+  // keep the resolved action while the same parameter is changed
+  ctl_channel *st = &m->state[channel];
+  if (st->nrpn != number){
+    st->nrpn = number;
+    st->nrpn_action = find_nrpn(m, channel, number);
+  }
+  return decoded(st->nrpn_action, value & MAX_14BIT, MAX_14BIT, out);
+}
+
+bool ctlmap_bend(controller_map *m, int channel, int value, ctl_value *out)
+{
+  if ((channel < 0) || (channel >= CTL_CHANNELS)){
+    return false;
+  }
+  return decoded(m->bend[channel], value + 8192, MAX_14BIT, out);
+}
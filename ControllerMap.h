@@ -0,0 +1,112 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Controller map: binds 7-bit & 14-bit controllers, NRPNs and pitch bend of
+/// each midi channel to actions.
+///
+/// Bindings are compiled into a dense table indexed by channel & controller
+/// number, so an event costs a single lookup. The map also decodes the MSB/LSB
+/// pairs of 14-bit controllers and NRPN parameter select & data entry, and
+/// reports every controller as an action with a value out of 'max', 127 for
+/// 7-bit & 16383 for 14-bit sources.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CONTROLLER_MAP_H
+#define CONTROLLER_MAP_H
+
+#include <vector>
+
+#define CTL_CHANNELS 16
+// binds all channels
+#define CTL_ANY_CHANNEL -1
+// action of unbound controllers
+#define CTL_NO_ACTION 0
+
+enum ctl_kind {
+  CTL_UNBOUND,
+  CTL_7BIT,
+  // coarse & fine halves of a 14-bit controller, fine is coarse + 32
+  CTL_MSB,
+  CTL_LSB,
+  // NRPN parameter select, data entry & RPN select, which deselects the NRPN
+  CTL_NRPN_MSB,
+  CTL_NRPN_LSB,
+  CTL_DATA_MSB,
+  CTL_DATA_LSB,
+  CTL_RPN
+};
+
+struct ctl_slot {
+  unsigned char action;
+  unsigned char kind;
+};
+
+struct nrpn_binding {
+  int channel;
+  int number;
+  int action;
+};
+
+/// Decoder state of a channel
+struct ctl_channel {
+  // last coarse value of the 14-bit controllers
+  unsigned char msb[32];
+  // selected NRPN & its action, resolved when it is selected
+  int nrpn;
+  int nrpn_action;
+  int data_msb;
+};
+
+struct controller_map {
+  ctl_slot cc[CTL_CHANNELS][128];
+  int bend[CTL_CHANNELS];
+  std::vector<nrpn_binding> nrpns;
+  ctl_channel state[CTL_CHANNELS];
+};
+
+/// Decoded controller
+struct ctl_value {
+  int action;
+  int value;
+  int max;
+};
+
+/// Unbinds all controllers, leaving only NRPN select & data entry
+void ctlmap_clear(controller_map *m);
+
+/// Binds controller 'cc' of a channel, or of all channels for CTL_ANY_CHANNEL.
+/// A 14-bit binding takes 'cc' (0..31) & its fine half 'cc' + 32
+void ctlmap_bind_cc(controller_map *m, int channel, int cc, int action, bool fine);
+
+/// Binds NRPN 'number' (0..16383) of a channel or all channels
+void ctlmap_bind_nrpn(controller_map *m, int channel, int number, int action);
+
+/// Binds pitch bend of a channel or all channels
+void ctlmap_bind_bend(controller_map *m, int channel, int action);
+
+/// Reads bindings from a text file, one per line:
+///
+///   cc    <channel> <number> <action>
+///   cc14  <channel> <number> <action>
+///   nrpn  <channel> <number> <action>
+///   bend  <channel> <action>
+///
+/// Channels are 1..16 or '*', numbers decimal or 0x hex & actions are looked
+/// up in 'names', whose index is the action. '#' starts a comment. The file
+/// replaces all bindings of the map. Throws runtime_error on a bad line
+void ctlmap_load(controller_map *m, const char *path, const char * const *names, int num_names);
+
+/// Decodes a controller change of 7 bits
+/// \return true if 'out' holds an action to apply
+bool ctlmap_control(controller_map *m, int channel, int cc, int value, ctl_value *out);
+
+/// Decodes a 14-bit controller change whose halves were already paired
+bool ctlmap_control14(controller_map *m, int channel, int cc, int value, ctl_value *out);
+
+/// Decodes a complete NRPN change
+bool ctlmap_nrpn(controller_map *m, int channel, int number, int value, ctl_value *out);
+
+/// Decodes pitch bend of -8192..8191
+bool ctlmap_bend(controller_map *m, int channel, int value, ctl_value *out);
+
+#endif
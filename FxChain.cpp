@@ -0,0 +1,161 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Insert chain of a channel: biquad filter, drive, gain & pan.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "FxChain.h"
+
+using namespace std;
+
+// low level gain of full drive
+#define MAX_DRIVE 8.0f
+
+
+void fx_reset(fx_chain *c)
+{
+  c->b0 = 1;
+  c->b1 = c->b2 = c->a1 = c->a2 = 0;
+  memset(c->z1, 0, sizeof(c->z1));
+  memset(c->z2, 0, sizeof(c->z2));
+  c->drive = 0;
+  c->gain[0] = c->gain[1] = 1;
+  c->target[0] = c->target[1] = 1;
+}
+
+bool fx_neutral(const fx_settings *s)
+{
+  return (s->filter == FILTER_OFF) && (s->drive == 0) && (s->gain == 1) && (s->pan == 0);
+}
+
+void fx_update(fx_chain *c, const fx_settings *s, unsigned int rate)
+{
+  // RBJ cookbook filters, normalised by a0
+  float f = min(s->cutoff, 0.49f * rate);
+  float w0 = 2 * (float)M_PI * f / rate;
+  float cw = cosf(w0);
+  float alpha = sinf(w0) / (2 * max(s->resonance, 0.1f));
+  float a0 = 1 + alpha;
+
+  switch (s->filter){
+    case FILTER_LOWPASS:
+      c->b0 = c->b2 = (1 - cw) / 2 / a0;
+      c->b1 = (1 - cw) / a0;
+      break;
+    case FILTER_HIGHPASS:
+      c->b0 = c->b2 = (1 + cw) / 2 / a0;
+      c->b1 = -(1 + cw) / a0;
+      break;
+    case FILTER_BANDPASS:
+      c->b0 = alpha / a0;
+      c->b1 = 0;
+      c->b2 = -alpha / a0;
+      break;
+    case FILTER_OFF:
+      c->b0 = 1;
+      c->b1 = c->b2 = c->a1 = c->a2 = 0;
+      break;
+  }
+  if (s->filter != FILTER_OFF){
+    c->a1 = -2 * cw / a0;
+    c->a2 = (1 - alpha) / a0;
+  }
+
+  c->drive = s->drive * MAX_DRIVE;
+
+  // balance, the centre is unity on both sides
+  c->target[0] = s->gain * min(1.0f, 1 - s->pan);
+  c->target[1] = s->gain * min(1.0f, 1 + s->pan);
+}
+
+void fx_process(fx_chain *a, const float *bus_a, fx_chain *b, const float *bus_b,
+    float *mix, int frames)
+{
+  // a single chain is paired with a silent one reading its bus
+  fx_chain silent;
+  if (b == NULL){
+    fx_reset(&silent);
+    silent.gain[0] = silent.gain[1] = silent.target[0] = silent.target[1] = 0;
+    b = &silent;
+    bus_b = bus_a;
+  }
+
+#ifdef __SSE__
+  __m128 b0 = _mm_setr_ps(a->b0, a->b0, b->b0, b->b0);
+  __m128 b1 = _mm_setr_ps(a->b1, a->b1, b->b1, b->b1);
+  __m128 b2 = _mm_setr_ps(a->b2, a->b2, b->b2, b->b2);
+  __m128 a1 = _mm_setr_ps(a->a1, a->a1, b->a1, b->a1);
+  __m128 a2 = _mm_setr_ps(a->a2, a->a2, b->a2, b->a2);
+  __m128 z1 = _mm_setr_ps(a->z1[0], a->z1[1], b->z1[0], b->z1[1]);
+  __m128 z2 = _mm_setr_ps(a->z2[0], a->z2[1], b->z2[0], b->z2[1]);
+  __m128 k = _mm_setr_ps(a->drive, a->drive, b->drive, b->drive);
+  __m128 k1 = _mm_add_ps(k, _mm_set1_ps(1));
+  __m128 g = _mm_setr_ps(a->gain[0], a->gain[1], b->gain[0], b->gain[1]);
+  __m128 gt = _mm_setr_ps(a->target[0], a->target[1], b->target[0], b->target[1]);
+  __m128 dg = _mm_mul_ps(_mm_sub_ps(gt, g), _mm_set1_ps(1.0f / frames));
+  __m128 sign = _mm_set1_ps(-0.0f);
+  __m128 one = _mm_set1_ps(1);
+
+  for (int i = 0; i < frames; i++){
+    __m128 x = _mm_loadl_pi(_mm_setzero_ps(), (const __m64 *)(bus_a + 2*i));
+    x = _mm_loadh_pi(x, (const __m64 *)(bus_b + 2*i));
+
+    // filter
+    __m128 y = _mm_add_ps(_mm_mul_ps(b0, x), z1);
+    z1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, x), _mm_mul_ps(a1, y)), z2);
+    z2 = _mm_sub_ps(_mm_mul_ps(b2, x), _mm_mul_ps(a2, y));
+
+    // drive, y * (1 + k) / (1 + k |y|)
+    __m128 d = _mm_add_ps(one, _mm_mul_ps(k, _mm_andnot_ps(sign, y)));
+    y = _mm_div_ps(_mm_mul_ps(y, k1), d);
+
+    // gain & pan, both buses add to the mix
+    g = _mm_add_ps(g, dg);
+    y = _mm_mul_ps(y, g);
+    y = _mm_add_ps(y, _mm_movehl_ps(y, y));
+    __m128 m = _mm_loadl_pi(_mm_setzero_ps(), (const __m64 *)(mix + 2*i));
+    _mm_storel_pi((__m64 *)(mix + 2*i), _mm_add_ps(m, y));
+  }
+
+  float s1[4], s2[4];
+  _mm_storeu_ps(s1, z1);
+  _mm_storeu_ps(s2, z2);
+  a->z1[0] = s1[0]; a->z1[1] = s1[1]; b->z1[0] = s1[2]; b->z1[1] = s1[3];
+  a->z2[0] = s2[0]; a->z2[1] = s2[1]; b->z2[0] = s2[2]; b->z2[1] = s2[3];
+#else
+  fx_chain *chains[2] = {a, b};
+  const float *buses[2] = {bus_a, bus_b};
+  for (int n = 0; n < 2; n++){
+    fx_chain *c = chains[n];
+    for (int ch = 0; ch < 2; ch++){
+      float z1 = c->z1[ch], z2 = c->z2[ch];
+      float g = c->gain[ch];
+      float dg = (c->target[ch] - g) / frames;
+      for (int i = 0; i < frames; i++){
+        float x = buses[n][2*i + ch];
+        float y = c->b0 * x + z1;
+        z1 = c->b1 * x - c->a1 * y + z2;
+        z2 = c->b2 * x - c->a2 * y;
+        y = y * (1 + c->drive) / (1 + c->drive * fabsf(y));
+        g += dg;
+        mix[2*i + ch] += y * g;
+      }
+      c->z1[ch] = z1;
+      c->z2[ch] = z2;
+    }
+  }
+#endif
+
+  a->gain[0] = a->target[0];
+  a->gain[1] = a->target[1];
+  b->gain[0] = b->target[0];
+  b->gain[1] = b->target[1];
+}
@@ -0,0 +1,67 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Tempo of incoming MIDI clock.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include <math.h>
+
+#include "MidiClock.h"
+
+// a tick this many periods late means the clock stopped, lock again
+#define MAX_LATE_PERIODS 4
+
+
+void pll_reset(clock_pll *pll, double bandwidth)
+{
+  pll->bandwidth = bandwidth;
+  pll->ticks = 0;
+  pll->last = -1;
+  pll->next = 0;
+  pll->period = 0;
+}
+
+void pll_tick(clock_pll *pll, double now)
+{
+  pll->ticks++;
+
+  // clock stopped for a while
+  if ((pll->period > 0) && (now - pll->next > MAX_LATE_PERIODS * pll->period)){
+    pll->period = 0;
+    pll->last = -1;
+  }
+
+  // the first two ticks give the initial period
+  if (pll->period <= 0){
+    if (pll->last >= 0){
+      pll->period = now - pll->last;
+      pll->next = now + pll->period;
+    }
+    pll->last = now;
+    return;
+  }
+
+  double err = now - pll->next;
+
+  // loop gains of a critically damped loop at the bandwidth, relative to
+  // the tick rate
+  double omega = 2 * M_PI * pll->bandwidth * pll->period;
+  double b = sqrt(2.0) * omega;
+  double c = omega * omega;
+
+  pll->next += pll->period + b * err;
+  pll->period += c * err;
+}
+
+bool pll_locked(const clock_pll *pll)
+{
+  return pll->period > 0;
+}
+
+float pll_bpm(const clock_pll *pll)
+{
+  if (pll->period <= 0){
+    return 0;
+  }
+  return (float)(60.0 / (pll->period * CLOCK_PPQN));
+}
@@ -0,0 +1,47 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Tempo of incoming MIDI clock.
+///
+/// Clock ticks arrive with the jitter of the sender, the transport and the
+/// scheduling of the midi thread. A second order delay locked loop predicts
+/// the time of each tick and corrects its phase & period estimate by the
+/// prediction error, which filters the jitter with a bandwidth of a fraction
+/// of the tick rate. Each tick costs a few multiplications.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef MIDI_CLOCK_H
+#define MIDI_CLOCK_H
+
+// MIDI clock ticks per quarter note
+#define CLOCK_PPQN 24
+
+struct clock_pll {
+  // loop bandwidth in Hz
+  double bandwidth;
+
+  // ticks received since reset
+  unsigned long int ticks;
+
+  // time of the previous tick while the period is unknown, < 0 for none
+  double last;
+
+  // predicted time of the next tick & seconds per tick, 0 if unknown
+  double next;
+  double period;
+};
+
+/// Forgets tempo & tick count, e.g. on start
+void pll_reset(clock_pll *pll, double bandwidth);
+
+/// Feeds a tick received at 'now' seconds. After a dropout the period is
+/// measured again, ticks keep counting
+void pll_tick(clock_pll *pll, double now);
+
+/// \return true once the period is known
+bool pll_locked(const clock_pll *pll);
+
+/// \return filtered tempo in beats per minute
+float pll_bpm(const clock_pll *pll);
+
+#endif
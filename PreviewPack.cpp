@@ -0,0 +1,196 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Preview pack: a single memory mapped file holding the first frames of every
+/// sample of a library.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "PreviewPack.h"
+
+using namespace soundtouch;
+using namespace std;
+
+static const char pack_magic[8] = {'C', 'H', 'P', 'P', 'A', 'C', 'K', 0};
+
+struct pack_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t rate;
+  int64_t head_frames;
+  // records in the file, used or free
+  uint32_t records;
+};
+
+
+static size_t round_up(size_t n, size_t page)
+{
+  return (n + page - 1) / page * page;
+}
+
+// maps the next chunk of records, growing the file to hold it
+static bool map_chunk(preview_pack *p)
+{
+  size_t len = PACK_CHUNK_RECORDS * p->record_size;
+  off_t offset = p->page_size + p->chunks.size() * len;
+  struct stat st;
+  if ((fstat(p->fd, &st) != 0) ||
+      ((st.st_size < (off_t)(offset + len)) && (ftruncate(p->fd, offset + len) != 0))){
+    return false;
+  }
+  void *m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, offset);
+  if (m == MAP_FAILED){
+    return false;
+  }
+  // not locked even if future mappings of the process are
+  munlock(m, len);
+  p->chunks.push_back((char *)m);
+  return true;
+}
+
+bool pack_open(preview_pack *p, const char *path, unsigned int rate, long int head_frames)
+{
+  p->page_size = sysconf(_SC_PAGESIZE);
+  p->record_size = p->page_size +
+    round_up(head_frames * PACK_CHANNELS * sizeof(SAMPLETYPE), p->page_size);
+  p->chunks.clear();
+  p->index.clear();
+  p->free_records.clear();
+  p->header = NULL;
+
+  p->fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (p->fd < 0){
+    return false;
+  }
+  struct stat st;
+  if ((fstat(p->fd, &st) != 0) ||
+      ((st.st_size < (off_t)p->page_size) && (ftruncate(p->fd, p->page_size) != 0))){
+    pack_close(p);
+    return false;
+  }
+  void *m = mmap(NULL, p->page_size, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, 0);
+  if (m == MAP_FAILED){
+    pack_close(p);
+    return false;
+  }
+  p->header = (pack_header *)m;
+  pack_header *h = p->header;
+
+  // start over when made for other heads, records are cut to the file
+  size_t records = (st.st_size > (off_t)p->page_size) ?
+    (st.st_size - p->page_size) / p->record_size : 0;
+  if ((memcmp(h->magic, pack_magic, sizeof(pack_magic)) != 0) ||
+      (h->version != PACK_VERSION) || (h->rate != rate) || (h->head_frames != head_frames)){
+    memcpy(h->magic, pack_magic, sizeof(pack_magic));
+    h->version = PACK_VERSION;
+    h->rate = rate;
+    h->head_frames = head_frames;
+    h->records = 0;
+  } else if (h->records > records){
+    h->records = records;
+  }
+
+  while (p->chunks.size() * PACK_CHUNK_RECORDS < h->records){
+    if (!map_chunk(p)){
+      pack_close(p);
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < h->records; i++){
+    pack_entry *e = pack_entry_at(p, i);
+    e->name[PACK_NAME_LEN - 1] = 0;
+    if (e->name[0] != 0){
+      p->index[e->name] = i;
+    } else {
+      p->free_records.push_back(i);
+    }
+  }
+  return true;
+}
+
+void pack_close(preview_pack *p)
+{
+  for (size_t i = 0; i < p->chunks.size(); i++){
+    munmap(p->chunks[i], PACK_CHUNK_RECORDS * p->record_size);
+  }
+  p->chunks.clear();
+  if (p->header != NULL){
+    munmap(p->header, p->page_size);
+    p->header = NULL;
+  }
+  if (p->fd >= 0){
+    close(p->fd);
+    p->fd = -1;
+  }
+}
+
+int pack_find(const preview_pack *p, const char *name)
+{
+  unordered_map<string, int>::const_iterator it = p->index.find(name);
+  return (it == p->index.end()) ? -1 : it->second;
+}
+
+bool pack_fresh(const preview_pack *p, int i, int64_t size, int64_t mtime)
+{
+  const pack_entry *e = pack_entry_at(p, i);
+  return (e->size == size) && (e->mtime == mtime);
+}
+
+int pack_reserve(preview_pack *p, const char *name)
+{
+  if (strlen(name) >= PACK_NAME_LEN){
+    return -1;
+  }
+  int i = pack_find(p, name);
+  if (i < 0){
+    if (p->free_records.size() > 0){
+      i = p->free_records.back();
+      p->free_records.pop_back();
+    } else {
+      i = p->header->records;
+      if ((i >= (int)(p->chunks.size() * PACK_CHUNK_RECORDS)) && !map_chunk(p)){
+        return -1;
+      }
+      p->header->records++;
+    }
+    p->index[name] = i;
+  }
+
+  pack_entry *e = pack_entry_at(p, i);
+  memset(e, 0, sizeof(pack_entry));
+  strcpy(e->name, name);
+  e->size = -1;
+  e->mtime = -1;
+  return i;
+}
+
+void pack_drop(preview_pack *p, int i)
+{
+  pack_entry *e = pack_entry_at(p, i);
+  p->index.erase(e->name);
+  e->name[0] = 0;
+  e->size = -1;
+}
+
+pack_entry *pack_entry_at(const preview_pack *p, int i)
+{
+  return (pack_entry *)(p->chunks[i / PACK_CHUNK_RECORDS] +
+      (i % PACK_CHUNK_RECORDS) * p->record_size);
+}
+
+SAMPLETYPE *pack_head(const preview_pack *p, int i)
+{
+  return (SAMPLETYPE *)((char *)pack_entry_at(p, i) + p->page_size);
+}
+
+void pack_unlock(preview_pack *p)
+{
+  for (size_t i = 0; i < p->chunks.size(); i++){
+    munlock(p->chunks[i], PACK_CHUNK_RECORDS * p->record_size);
+  }
+}
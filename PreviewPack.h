@@ -0,0 +1,96 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Preview pack: a single memory mapped file holding the first frames of every
+/// sample of a library, so that browsing doesn't have to open & decode files.
+///
+/// The pack is a header page followed by fixed size records, one per sample
+/// file. A record is a page of metadata and a slot for the head of the file,
+/// converted to the rate of the pcm. Records are keyed by file name and carry
+/// the size & modification time of the file they were made from, so the pack
+/// is brought up to date incrementally by rewriting only stale records.
+///
+/// Records are mapped in chunks that stay at their address until the pack is
+/// closed, so heads can be played straight from the mapping.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef PREVIEW_PACK_H
+#define PREVIEW_PACK_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <soundtouch/STTypes.h>
+
+#define PACK_VERSION 2
+#define PACK_NAME_LEN 256
+// max channels of a head
+#define PACK_CHANNELS 2
+// records mapped at a time
+#define PACK_CHUNK_RECORDS 64
+
+struct pack_entry {
+  // file name in the library, empty for unused records
+  char name[PACK_NAME_LEN];
+  // size & modification time of the file the head was made from, -1 while
+  // the head is being written
+  int64_t size;
+  int64_t mtime;
+  // format of the file
+  uint32_t file_rate;
+  uint32_t file_channels;
+  uint32_t bits;
+  uint32_t head_channels;
+  int64_t file_frames;
+  // frames in the head, at the rate of the pack
+  int64_t head_frames;
+  // tempo detected in the head, 0 if none
+  float bpm;
+};
+
+struct preview_pack {
+  int fd;
+  // mapped header page
+  struct pack_header *header;
+  size_t page_size;
+  size_t record_size;
+  std::vector<char *> chunks;
+  // record of each file name & records that were free when opened
+  std::unordered_map<std::string, int> index;
+  std::vector<int> free_records;
+};
+
+/// Opens or creates the pack at 'path' for heads of at most 'head_frames'
+/// frames at 'rate'. A pack made for another rate or head size is emptied
+/// \return false if the pack couldn't be opened or mapped
+bool pack_open(preview_pack *p, const char *path, unsigned int rate, long int head_frames);
+
+/// Unmaps & closes the pack, heads can't be used after it
+void pack_close(preview_pack *p);
+
+/// \return record of 'name', -1 if there is none
+int pack_find(const preview_pack *p, const char *name);
+
+/// \return true if record 'i' was made from a file of given size & time
+bool pack_fresh(const preview_pack *p, int i, int64_t size, int64_t mtime);
+
+/// Takes the record of 'name' for (re)writing, a new one if there is none.
+/// The record is stale until its size & time are set after writing the head
+/// \return record, -1 if the pack couldn't be grown
+int pack_reserve(preview_pack *p, const char *name);
+
+/// Frees the record of a file that is gone or changed. The record is only
+/// reused once the pack is reopened, its head stays playable until then
+void pack_drop(preview_pack *p, int i);
+
+pack_entry *pack_entry_at(const preview_pack *p, int i);
+
+/// Head slot of record 'i', room for the max head frames of PACK_CHANNELS
+soundtouch::SAMPLETYPE *pack_head(const preview_pack *p, int i);
+
+/// Unlocks the mapping after the process was locked into memory, pages
+/// of the pack are only brought in as they are played
+void pack_unlock(preview_pack *p);
+
+#endif
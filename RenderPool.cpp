@@ -0,0 +1,174 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Fork-join pool spreading the jobs of a period over pinned worker threads.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include <time.h>
+#include <thread>
+#include <algorithm>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "RtMemory.h"
+#include "RenderPool.h"
+
+using namespace std;
+
+// a worker keeps spinning this long after a join, periods mixed back to
+// back fork right away
+#define GRACE_NS 20000
+// & wakes this long before the next period is due
+#define SPIN_AHEAD_NS 200000
+// sleep between looks once a fork is overdue, e.g. while the pcm recovers
+#define IDLE_SLEEP_NS 200000
+// spins between looks at the clock
+#define SPINS_PER_CHECK 64
+
+
+static inline int64_t now_ns()
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void sleep_until(int64_t ns)
+{
+  timespec t;
+  t.tv_sec = ns / 1000000000LL;
+  t.tv_nsec = ns % 1000000000LL;
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+}
+
+static inline void spin_pause()
+{
+#ifdef __SSE__
+  _mm_pause();
+#endif
+}
+
+static inline uint32_t generation(uint64_t work)
+{
+  return (uint32_t)(work >> 32);
+}
+
+static inline int batch_size(uint64_t work)
+{
+  return (int)((work >> 16) & 0xffff);
+}
+
+static inline int next_job(uint64_t work)
+{
+  return (int)(work & 0xffff);
+}
+
+// runs jobs of generation 'gen' until there are none left. The batch size
+// is read from the same word as the job, a worker still holding the word of
+// an earlier batch can't claim a job of a later one
+static void take_jobs(render_pool *p, uint32_t gen)
+{
+  uint64_t w = p->work.load(memory_order_acquire);
+  while ((generation(w) == gen) && (next_job(w) < batch_size(w))){
+    if (p->work.compare_exchange_weak(w, w + 1, memory_order_acquire)){
+      p->job(p->arg, next_job(w));
+      p->done.fetch_add(1, memory_order_release);
+      w = p->work.load(memory_order_acquire);
+    }
+  }
+}
+
+// spins for a generation after 'seen', sleeping through the part of the
+// period no fork is expected in
+static uint32_t wait_fork(render_pool *p, uint32_t seen)
+{
+  int64_t joined = now_ns();
+  bool slept = false;
+  for (int spins = 1; ; spins++){
+    uint32_t gen = generation(p->work.load(memory_order_acquire));
+    if (gen != seen){
+      return gen;
+    }
+    spin_pause();
+    if (spins % SPINS_PER_CHECK != 0){
+      continue;
+    }
+
+    int64_t now = now_ns();
+    int64_t due = p->fork_ns.load(memory_order_relaxed) + p->period_ns;
+    if (!slept && (now - joined > GRACE_NS)){
+      slept = true;
+      if (now < due - SPIN_AHEAD_NS){
+        sleep_until(due - SPIN_AHEAD_NS);
+      }
+    } else if (now > due + p->period_ns){
+      sleep_until(now + IDLE_SLEEP_NS);
+    }
+  }
+}
+
+static void worker(render_pool *p, size_t stack)
+{
+  rt_prefault_stack(stack);
+  rt_enter_audio_thread();
+#ifdef __SSE__
+  // same denormal handling as the audio thread
+  _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+#endif
+
+  uint32_t seen = generation(p->work.load(memory_order_acquire));
+  while (1){
+    seen = wait_fork(p, seen);
+    take_jobs(p, seen);
+  }
+}
+
+bool pool_start(render_pool *p, int threads, int64_t period_ns, size_t stack, int priority)
+{
+  p->threads = max(1, min(POOL_MAX_THREADS, threads));
+  p->period_ns = period_ns;
+  p->fork_ns = now_ns();
+  p->job = NULL;
+  p->arg = NULL;
+  p->work = 0;
+  p->done = 0;
+
+  bool ok = true;
+  for (int i = 1; i < p->threads; i++){
+    thread t(worker, p, stack);
+    ok &= rt_pin_cpu(t.native_handle(), i);
+    if (priority > 0){
+      ok &= rt_set_fifo(t.native_handle(), priority);
+    }
+    t.detach();
+  }
+  return ok;
+}
+
+void pool_run(render_pool *p, pool_job job, void *arg, int count)
+{
+  if (p->threads > 1){
+    p->fork_ns.store(now_ns(), memory_order_relaxed);
+  }
+  if ((p->threads == 1) || (count <= 1)){
+    for (int i = 0; i < count; i++){
+      job(arg, i);
+    }
+    return;
+  }
+
+  // publish the batch with the next generation
+  p->job = job;
+  p->arg = arg;
+  p->done.store(0, memory_order_relaxed);
+  uint32_t gen = generation(p->work.load(memory_order_relaxed)) + 1;
+  p->work.store(((uint64_t)gen << 32) | ((uint64_t)count << 16), memory_order_release);
+
+  // join in, then wait for jobs still running on workers
+  take_jobs(p, gen);
+  while (p->done.load(memory_order_acquire) < count){
+    spin_pause();
+  }
+}
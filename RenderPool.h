@@ -0,0 +1,67 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Fork-join pool spreading the jobs of a period over pinned worker threads.
+///
+/// The audio thread forks a batch of jobs by publishing them with a new
+/// generation, takes jobs itself & then spins until all are done. Workers
+/// claim jobs one at a time from a single atomic word holding the
+/// generation, the size of the batch & the next job, so jobs are balanced
+/// between whichever threads turn up & a worker late from a previous period
+/// can't take a job of the next. Jobs write only their own output, whoever ran them, so
+/// results don't depend on the number of threads or their timing.
+///
+/// Workers busy-wait for the fork rather than sleep on the OS, waking takes
+/// tens of microseconds. To keep spinning cores to a fraction of the period,
+/// and realtime threads clear of throttling, a worker that saw no fork right
+/// after a join sleeps until shortly before the next period is due & only
+/// spins from there. A fork that comes early is started by the audio thread
+/// alone and joined by the workers as they arrive.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RENDER_POOL_H
+#define RENDER_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+// threads of a pool, the calling thread included
+#define POOL_MAX_THREADS 16
+// jobs of a batch
+#define POOL_MAX_JOBS 0xffff
+
+/// Job 'index' of a batch
+typedef void (*pool_job)(void *arg, int index);
+
+struct render_pool {
+  int threads;
+  // expected time between forks & the time of the last fork, in ns
+  int64_t period_ns;
+  std::atomic<int64_t> fork_ns;
+
+  // batch of the current generation, set before it is published. Job &
+  // argument are only read once a job of it is claimed
+  pool_job job;
+  void *arg;
+
+  // generation in the high half, jobs of the batch & the next job in 16
+  // bits each of the low half
+  alignas(64) std::atomic<uint64_t> work;
+  // jobs of the generation finished
+  alignas(64) std::atomic<int> done;
+};
+
+/// Starts 'threads' - 1 workers pinned to cpus 1, 2, .. & at SCHED_FIFO
+/// 'priority' if above 0. Workers prefault 'stack' bytes of stack & are
+/// marked as audio threads
+/// \return false if a worker couldn't be pinned or made realtime, it still
+/// runs
+bool pool_start(render_pool *p, int threads, int64_t period_ns, size_t stack, int priority);
+
+/// Runs jobs 0 .. 'count' - 1 on the pool & the calling thread, 'count' is at
+/// most POOL_MAX_JOBS
+/// \return once all are done
+void pool_run(render_pool *p, pool_job job, void *arg, int count);
+
+#endif
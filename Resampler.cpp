@@ -0,0 +1,261 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Polyphase windowed-sinc sample rate converter.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include <math.h>
+#include <string.h>
+#include <assert.h>
+#include <thread>
+#include <vector>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "Resampler.h"
+
+using namespace std;
+
+// Kaiser window shape & the stop band attenuation it gives, in dB
+#define KAISER_BETA 8.0
+#define ATTENUATION 80.0
+
+// Below this many output frames conversion is done on the calling thread only
+#define MIN_FRAMES_PER_THREAD 32768
+
+
+static uint64_t gcd(uint64_t a, uint64_t b)
+{
+    while (b != 0)
+    {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+
+// zeroth order modified Bessel function of the first kind
+static double besselI0(double x)
+{
+    double sum = 1.0;
+    double term = 1.0;
+
+    for (int k = 1; k < 32; k ++)
+    {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-12) break;
+    }
+    return sum;
+}
+
+
+// dot product of 'n' elements, 'n' multiple of 4 & 'b' 16-byte aligned
+static inline float dotProduct(const float *a, const float *b, int n)
+{
+#ifdef __SSE__
+    __m128 acc = _mm_setzero_ps();
+    float sum[4];
+
+    for (int i = 0; i < n; i += 4)
+    {
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_load_ps(b + i)));
+    }
+    _mm_storeu_ps(sum, acc);
+    return (sum[0] + sum[1]) + (sum[2] + sum[3]);
+#else
+    float sum = 0;
+
+    for (int i = 0; i < n; i ++)
+    {
+        sum += a[i] * b[i];
+    }
+    return sum;
+#endif
+}
+
+
+Resampler::Resampler(uint inRate, uint outRate)
+{
+    uint64_t div;
+
+    assert((inRate > 0) && (outRate > 0));
+    this->inRate = inRate;
+    this->outRate = outRate;
+
+    div = gcd(inRate, outRate);
+    upFactor = outRate / div;
+    downFactor = inRate / div;
+    numPhases = (upFactor < MAX_PHASES) ? (int)upFactor : (int)MAX_PHASES;
+
+    coeffs = NULL;
+    coeffsBuff = NULL;
+    designFilter();
+}
+
+
+Resampler::~Resampler()
+{
+    delete[] coeffsBuff;
+}
+
+
+void Resampler::designFilter()
+{
+    double nyquist;
+    double transition;
+    double cutoff;
+
+    // lower Nyquist frequency in cycles per input sample; when decimating,
+    // the filter is widened to keep the same number of zero crossings
+    nyquist = 0.5;
+    if (outRate < inRate) nyquist *= (double)outRate / (double)inRate;
+
+    halfLen = (int)ceil(ZERO_CROSSINGS / (2.0 * nyquist));
+    numTaps = (2 * halfLen + 3) & ~3;
+
+    // the stop band starts at the Nyquist frequency, the pass band ends a
+    // transition band of the Kaiser window below it & the cutoff (-6 dB) is
+    // half way between
+    transition = (ATTENUATION - 7.95) / (14.36 * 2 * halfLen);
+    cutoff = nyquist - transition / 2;
+
+    coeffsBuff = new float[numPhases * numTaps + 4];
+    coeffs = (float *)(((uintptr_t)coeffsBuff + 15) & ~(uintptr_t)15);
+
+    double i0Beta = besselI0(KAISER_BETA);
+    for (int p = 0; p < numPhases; p ++)
+    {
+        float *row = coeffs + p * numTaps;
+        double frac = (double)p / (double)numPhases;
+        double sum = 0;
+
+        for (int k = 0; k < numTaps; k ++)
+        {
+            // distance of the tap from the output position in input samples
+            double d = k - (halfLen - 1) - frac;
+            double x = d / halfLen;
+            double h = 0;
+
+            if ((k < 2 * halfLen) && (fabs(x) < 1.0))
+            {
+                double w = besselI0(KAISER_BETA * sqrt(1.0 - x * x)) / i0Beta;
+                double t = 2.0 * cutoff * d;
+                double sinc = (fabs(t) < 1e-9) ? 1.0 : sin(M_PI * t) / (M_PI * t);
+                h = 2.0 * cutoff * sinc * w;
+            }
+            row[k] = (float)h;
+            sum += h;
+        }
+
+        // unity gain at DC for every phase
+        for (int k = 0; k < numTaps; k ++)
+        {
+            row[k] = (float)(row[k] / sum);
+        }
+    }
+}
+
+
+long Resampler::getOutputFrames(long inFrames) const
+{
+    return (long)(((uint64_t)inFrames * upFactor + downFactor - 1) / downFactor);
+}
+
+
+void Resampler::processRange(const float * const *planar, long inFrames, int channels,
+                             long first, long last, float *out) const
+{
+    for (long n = first; n < last; n ++)
+    {
+        uint64_t num = (uint64_t)n * downFactor;
+        long i = (long)(num / upFactor);
+        uint64_t rem = num % upFactor;
+        int phase = (int)((rem * numPhases + upFactor / 2) / upFactor);
+
+        if (phase == numPhases)
+        {
+            phase = 0;
+            i ++;
+        }
+
+        // planar buffers are padded by 'halfLen' zeros in front and by
+        // 'numTaps' + 1 behind
+        const float *row = coeffs + phase * numTaps;
+        long base = i + 1;
+        assert(base + numTaps <= halfLen + inFrames + numTaps + 1);
+        for (int c = 0; c < channels; c ++)
+        {
+            out[n * channels + c] = dotProduct(planar[c] + base, row, numTaps);
+        }
+    }
+}
+
+
+long Resampler::process(const float *in, long inFrames, int channels, float *out,
+                        int numThreads) const
+{
+    long outFrames;
+    long padded;
+    vector<float *> planar(channels);
+
+    outFrames = getOutputFrames(inFrames);
+    if (outFrames == 0) return 0;
+
+    // deinterleave to zero padded planar buffers so that the filter can run
+    // over both ends without bounds checks
+    padded = halfLen + inFrames + numTaps + 1;
+    for (int c = 0; c < channels; c ++)
+    {
+        float *buff = new float[padded];
+
+        memset(buff, 0, padded * sizeof(float));
+        for (long i = 0; i < inFrames; i ++)
+        {
+            buff[halfLen + i] = in[i * channels + c];
+        }
+        planar[c] = buff;
+    }
+
+    if (numThreads == 0)
+    {
+        numThreads = (int)thread::hardware_concurrency();
+    }
+    if (numThreads > outFrames / MIN_FRAMES_PER_THREAD)
+    {
+        numThreads = (int)(outFrames / MIN_FRAMES_PER_THREAD);
+    }
+
+    if (numThreads <= 1)
+    {
+        processRange(&planar[0], inFrames, channels, 0, outFrames, out);
+    }
+    else
+    {
+        // threads write disjoint ranges of the output
+        vector<thread> workers;
+        long chunk = (outFrames + numThreads - 1) / numThreads;
+
+        for (long first = 0; first < outFrames; first += chunk)
+        {
+            long last = (first + chunk < outFrames) ? first + chunk : outFrames;
+            workers.push_back(thread(&Resampler::processRange, this,
+                                     &planar[0], inFrames, channels, first, last, out));
+        }
+        for (size_t t = 0; t < workers.size(); t ++)
+        {
+            workers[t].join();
+        }
+    }
+
+    for (int c = 0; c < channels; c ++)
+    {
+        delete[] planar[c];
+    }
+
+    return outFrames;
+}
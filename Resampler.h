@@ -0,0 +1,85 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Polyphase windowed-sinc sample rate converter.
+///
+/// Converts whole sample buffers between two fixed rates, e.g. when a 48kHz
+/// file is loaded for a 44.1kHz device. The rate ratio is reduced to L/M and
+/// one FIR phase is precomputed for each of the L output positions, so that
+/// every output sample costs a single dot product. Dot products are done with
+/// SSE when available, and long buffers are split across threads.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <stdint.h>
+
+#ifndef uint
+typedef unsigned int uint;
+#endif
+
+
+class Resampler
+{
+private:
+    /// Converted rates
+    uint inRate;
+    uint outRate;
+
+    /// Rate ratio reduced to 'upFactor / downFactor'
+    uint64_t upFactor;
+    uint64_t downFactor;
+
+    /// Number of precomputed filter phases
+    int numPhases;
+
+    /// Filter half length in input samples
+    int halfLen;
+
+    /// Taps per phase, padded to a multiple of 4 for SIMD
+    int numTaps;
+
+    /// Coefficient table, 'numPhases' rows of 'numTaps' taps, 16-byte aligned
+    float *coeffs;
+    float *coeffsBuff;
+
+    /// Designs the Kaiser windowed sinc phases
+    void designFilter();
+
+    /// Computes output frames [first, last[ from zero-padded planar input
+    void processRange(const float * const *planar, long inFrames, int channels,
+                      long first, long last, float *out) const;
+
+public:
+    /// Max. number of phases. Rate ratios that don't reduce to this many phases
+    /// are converted with the nearest phase.
+    enum { MAX_PHASES = 1024 };
+
+    /// Zero crossings of the sinc on each side, i.e. filter quality. The
+    /// transition band is ~0.04 of the lower rate, the pass band is flat to
+    /// ~92% of its Nyquist frequency & the stop band is 85-92dB down from it
+    enum { ZERO_CROSSINGS = 64 };
+
+    /// Constructor: prepares conversion from 'inRate' to 'outRate'
+    Resampler(uint inRate, uint outRate);
+
+    ~Resampler();
+
+    /// Number of output frames produced from given number of input frames
+    long getOutputFrames(long inFrames) const;
+
+    /// Converts interleaved input buffer. Uses several threads if 'numThreads' is
+    /// zero or above one; zero picks the number of cores.
+    ///
+    /// \return Number of frames written to 'out', which must have room for
+    /// 'getOutputFrames(inFrames) * channels' elements.
+    long process(const float *in,   ///< Interleaved input frames
+                 long inFrames,     ///< Number of input frames
+                 int channels,      ///< Number of interleaved channels
+                 float *out,        ///< Interleaved output frames
+                 int numThreads = 0 ///< Number of worker threads, 0 for automatic
+                 ) const;
+};
+
+#endif
@@ -0,0 +1,145 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Memory discipline of the audio thread: a fixed arena for everything the
+/// audio thread touches, locked & prefaulted memory and realtime scheduling.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <alloca.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "RtMemory.h"
+
+// set for the audio thread
+static __thread bool audio_thread;
+
+
+bool rt_arena_init(rt_arena *arena, size_t size)
+{
+  void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED){
+    return false;
+  }
+  // write every page so that none is faulted in on the audio thread
+  memset(base, 0, size);
+
+  arena->base = (char *)base;
+  arena->size = size;
+  arena->used = 0;
+  return true;
+}
+
+void *rt_arena_alloc(rt_arena *arena, size_t size, size_t align)
+{
+  size_t off = (arena->used + align - 1) & ~(align - 1);
+  if (off + size > arena->size){
+    return NULL;
+  }
+  arena->used = off + size;
+  return arena->base + off;
+}
+
+bool rt_lock_memory()
+{
+  // with future pages locked allocations fail once the limit is reached,
+  // so those are only locked when there is no limit
+  int flags = MCL_CURRENT;
+  rlimit limit;
+  if ((getrlimit(RLIMIT_MEMLOCK, &limit) == 0) && (limit.rlim_cur == RLIM_INFINITY)){
+    flags |= MCL_FUTURE;
+  }
+  return mlockall(flags) == 0;
+}
+
+bool rt_set_fifo(pthread_t thread, int priority)
+{
+  sched_param param;
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = priority;
+  return pthread_setschedparam(thread, SCHED_FIFO, &param) == 0;
+}
+
+bool rt_pin_cpu(pthread_t thread, int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  CPU_SET((cpus > 0) ? cpu % cpus : 0, &set);
+  return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+void rt_prefault_stack(size_t size)
+{
+  volatile char *stack = (volatile char *)alloca(size);
+  long page = sysconf(_SC_PAGESIZE);
+  for (size_t i = 0; i < size; i += page){
+    stack[i] = 0;
+  }
+}
+
+void rt_prefault(const void *p, size_t size)
+{
+  const volatile char *c = (const volatile char *)p;
+  long page = sysconf(_SC_PAGESIZE);
+  for (size_t i = 0; i < size; i += page){
+    (void)c[i];
+  }
+  if (size > 0){
+    (void)c[size - 1];
+  }
+}
+
+void rt_enter_audio_thread()
+{
+  audio_thread = true;
+}
+
+
+#ifdef RT_MALLOC_TRAP
+
+// glibc allocator entry points, the public ones are overridden below
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+static void trap(const char *what)
+{
+  static const char msg[] = " called from the audio thread\n";
+  // no stdio, it may allocate itself
+  audio_thread = false;
+  write(2, what, strlen(what));
+  write(2, msg, sizeof(msg) - 1);
+  abort();
+}
+
+extern "C" void *malloc(size_t size)
+{
+  if (audio_thread){
+    trap("malloc");
+  }
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+  if (audio_thread){
+    trap("calloc");
+  }
+  return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+  if (audio_thread){
+    trap("realloc");
+  }
+  return __libc_realloc(ptr, size);
+}
+
+#endif
@@ -0,0 +1,56 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Memory discipline of the audio thread: a fixed arena for everything the
+/// audio thread touches, locked & prefaulted memory and realtime scheduling.
+///
+/// Building with RT_MALLOC_TRAP makes any malloc, calloc or realloc called
+/// from a thread marked with rt_enter_audio_thread abort with a message, so
+/// that allocations sneaking into the audio path show up in a debugger.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RT_MEMORY_H
+#define RT_MEMORY_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/// Fixed block of memory handed out front to back, never freed
+struct rt_arena {
+  char *base;
+  size_t size;
+  size_t used;
+};
+
+/// Allocates & prefaults an arena of 'size' bytes
+/// \return false if the memory couldn't be allocated
+bool rt_arena_init(rt_arena *arena, size_t size);
+
+/// Takes 'size' bytes aligned to 'align', a power of 2
+/// \return NULL if the arena is exhausted
+void *rt_arena_alloc(rt_arena *arena, size_t size, size_t align);
+
+/// Locks the pages of the process in memory, future ones as well when
+/// RLIMIT_MEMLOCK is unlimited
+/// \return false if not permitted
+bool rt_lock_memory();
+
+/// Runs 'thread' with SCHED_FIFO at given priority
+/// \return false if not permitted
+bool rt_set_fifo(pthread_t thread, int priority);
+
+/// Keeps 'thread' on 'cpu', taken modulo the cpus online
+/// \return false if not permitted
+bool rt_pin_cpu(pthread_t thread, int cpu);
+
+/// Touches 'size' bytes of stack below the caller so that it is faulted in
+void rt_prefault_stack(size_t size);
+
+/// Reads a byte of every page of 'size' bytes at 'p', so that mapped pages
+/// are brought in by the caller rather than by the audio thread
+void rt_prefault(const void *p, size_t size);
+
+/// Marks the calling thread as audio thread, see RT_MALLOC_TRAP
+void rt_enter_audio_thread();
+
+#endif
@@ -76,11 +76,23 @@ static const char usage[] =
     "  -tempo=n : Change sound tempo by n percents  (n=-95..+5000 %)\n"
     "  -pitch=n : Change sound pitch by n semitones (n=-60..+60 semitones)\n"
     "  -rate=n  : Change sound rate by n percents   (n=-95..+5000 %)\n"
-    "  -bpm=n   : Detect the BPM rate of sound and adjust tempo to meet 'n' BPMs.\n"
-    "             If '=n' is omitted, just detects the BPM rate.\n"
+    "  -bpm=n   : Match the tempo of loaded samples to a session tempo of 'n' BPMs.\n"
+    "             If '=n' is omitted, the first sample loaded sets the tempo.\n"
     "  -quick   : Use quicker tempo change algorithm (gain speed, lose quality)\n"
     "  -naa     : Don't use anti-alias filtering (gain speed, lose quality)\n"
     "  -speech  : Tune algorithm for speech processing (default is for music)\n"
+    "  -vel=n   : Velocity to gain curve exponent (n=0..4, 0 ignores velocity, default 1)\n"
+    "  -poly=n  : Voices per midi channel (n=1..32, default 8)\n"
+    "  -rt      : Lock memory & run the audio thread with realtime priority\n"
+    "  -clock=n : MIDI clock, 0 = internal, 1 = follow clock in, 2 = send clock out\n"
+    "  -smooth=n: Time constant of tempo/pitch/rate controllers in ms (n=0..2000, default 50)\n"
+    "  -map=file: Read controller bindings from 'file' instead of the default map\n"
+    "  -srate=n : Sample rate the engine runs at (n=8000..192000 Hz, default 44100),\n"
+    "             converted to the rate of each output device\n"
+    "  -threads=n: Render voices on n cores, 32 voices each (n=1..16, default 1)\n"
+    "  -out=dev/n: Play to ALSA pcm 'dev' with n channels (default 2). Repeat for more\n"
+    "             devices, channel pairs of all devices are output buses 0, 1, ..\n"
+    "  -route=a,b,..: Output bus of midi channels 1, 2, .. (default 0)\n"
     "  -license : Display the program license text (LGPL)\n";
 
 
@@ -126,6 +138,13 @@ RunParameters::RunParameters(const int nParams, const char * const paramStr[])
     goalBPM = 0;
     speech = false;
     detectBPM = false;
+    velocityCurve = 1.0f;
+    polyphony = 8;
+    realtime = false;
+    clockMode = 0;
+    smoothMs = 50;
+    engineRate = 44100;
+    threads = 1;
 
     // Get input & output file names
     samplePath = (char*)paramStr[1];
@@ -172,6 +191,56 @@ void RunParameters::checkLimits()
     {
         rateDelta = 5000.0f;
     }
+
+    if (smoothMs < 0.0f) 
+    {
+        smoothMs = 0.0f;
+    } 
+    else if (smoothMs > 2000.0f) 
+    {
+        smoothMs = 2000.0f;
+    }
+
+    if (engineRate < 8000) 
+    {
+        engineRate = 8000;
+    } 
+    else if (engineRate > 192000) 
+    {
+        engineRate = 192000;
+    }
+
+    if (threads < 1) 
+    {
+        threads = 1;
+    } 
+    else if (threads > 16) 
+    {
+        threads = 16;
+    }
+
+    if ((clockMode < 0) || (clockMode > 2)) 
+    {
+        clockMode = 0;
+    }
+
+    if (polyphony < 1) 
+    {
+        polyphony = 1;
+    } 
+    else if (polyphony > 32) 
+    {
+        polyphony = 32;
+    }
+
+    if (velocityCurve < 0.0f) 
+    {
+        velocityCurve = 0.0f;
+    } 
+    else if (velocityCurve > 4.0f) 
+    {
+        velocityCurve = 4.0f;
+    }
 }
 
 
@@ -208,6 +277,18 @@ float RunParameters::parseSwitchValue(const string &str) const
 }
 
 
+// Text of a switch after '=', which mustn't be empty
+string RunParameters::parseSwitchString(const string &str) const
+{
+    int pos = (int)str.find_first_of('=');
+    if ((pos < 0) || (pos + 1 == (int)str.size()))
+    {
+        throwIllegalParamExp(str);
+    }
+    return str.substr(pos + 1);
+}
+
+
 // Interprets a single switch parameter string of format "-switch=xx"
 // Valid switches are "-tempo=xx", "-pitch=xx" and "-rate=xx". Stores
 // switch values into 'params' structure.
@@ -228,20 +309,49 @@ void RunParameters::parseSwitchParam(const string &str)
     switch (upS) 
     {
         case 't' :
+            if (str.compare(1, 2, "th") == 0)
+            {
+                // switch '-threads=xx'
+                threads = (int)parseSwitchValue(str);
+                break;
+            }
             // switch '-tempo=xx'
             tempoDelta = parseSwitchValue(str);
             break;
 
         case 'p' :
+            if (str.compare(1, 4, "poly") == 0)
+            {
+                // switch '-poly=xx'
+                polyphony = (int)parseSwitchValue(str);
+                break;
+            }
             // switch '-pitch=xx'
             pitchDelta = parseSwitchValue(str);
             break;
 
         case 'r' :
+            if (str.compare(1, 2, "rt") == 0)
+            {
+                // switch '-rt'
+                realtime = true;
+                break;
+            }
+            if (str.compare(1, 5, "route") == 0)
+            {
+                // switch '-route=a,b,..'
+                routes = parseSwitchString(str);
+                break;
+            }
             // switch '-rate=xx'
             rateDelta = parseSwitchValue(str);
             break;
 
+        case 'c' :
+            // switch '-clock=xx'
+            clockMode = (int)parseSwitchValue(str);
+            break;
+
         case 'b' :
             // switch '-bpm=xx'
             detectBPM = true;
@@ -272,10 +382,37 @@ void RunParameters::parseSwitchParam(const string &str)
             break;
 
         case 's' :
+            if (str.compare(1, 2, "sm") == 0)
+            {
+                // switch '-smooth=xx'
+                smoothMs = parseSwitchValue(str);
+                break;
+            }
+            if (str.compare(1, 2, "sr") == 0)
+            {
+                // switch '-srate=xx'
+                engineRate = (int)parseSwitchValue(str);
+                break;
+            }
             // switch '-speech'
             speech = true;
             break;
 
+        case 'm' :
+            // switch '-map=file'
+            controllerMap = parseSwitchString(str);
+            break;
+
+        case 'o' :
+            // switch '-out=dev/n'
+            outputs.push_back(parseSwitchString(str));
+            break;
+
+        case 'v' :
+            // switch '-vel=xx'
+            velocityCurve = parseSwitchValue(str);
+            break;
+
         default:
             // unknown switch
             throwIllegalParamExp(str);
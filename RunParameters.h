@@ -34,6 +34,7 @@
 
 #include <soundtouch/STTypes.h>
 #include <string>
+#include <vector>
 
 using namespace std;
 
@@ -46,6 +47,7 @@ private:
     void parseSwitchParam(const string &str);
     void checkLimits();
     float parseSwitchValue(const string &str) const;
+    string parseSwitchString(const string &str) const;
 
 public:
     char  *samplePath;
@@ -59,6 +61,16 @@ public:
     float goalBPM;
     bool  detectBPM;
     bool  speech;
+    float velocityCurve;
+    int   polyphony;
+    bool  realtime;
+    int   clockMode;
+    float smoothMs;
+    int   engineRate;
+    int   threads;
+    string controllerMap;
+    vector<string> outputs;
+    string routes;
 
     RunParameters(const int nParams, const char * const paramStr[]);
 };
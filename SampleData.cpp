@@ -0,0 +1,73 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Reference counted sample audio shared between the control & audio threads.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stddef.h>
+
+#include "SampleData.h"
+
+using namespace soundtouch;
+using namespace std;
+
+
+sample_data *sample_data_new(SAMPLETYPE *frames, unsigned int channels, long int nframes)
+{
+  sample_data *d = new sample_data();
+  d->frames = frames;
+  d->owned = true;
+  d->channels = channels;
+  d->nframes = nframes;
+  d->refs = 1;
+  d->retired = false;
+  return d;
+}
+
+sample_data *sample_data_borrow(const SAMPLETYPE *frames, unsigned int channels,
+    long int nframes)
+{
+  sample_data *d = sample_data_new((SAMPLETYPE *)frames, channels, nframes);
+  d->owned = false;
+  return d;
+}
+
+void sample_data_ref(sample_data *d)
+{
+  d->refs.fetch_add(1, memory_order_relaxed);
+}
+
+void sample_data_unref(sample_data *d)
+{
+  d->refs.fetch_sub(1, memory_order_release);
+}
+
+void sample_data_release(vector<sample_data *> *retired, sample_data *d)
+{
+  if (d == NULL){
+    return;
+  }
+  sample_data_unref(d);
+  if (!d->retired){
+    d->retired = true;
+    retired->push_back(d);
+  }
+}
+
+void sample_data_reclaim(vector<sample_data *> *retired)
+{
+  size_t kept = 0;
+  for (size_t i = 0; i < retired->size(); i++){
+    sample_data *d = (*retired)[i];
+    // no holder is left that could take a new reference
+    if (d->refs.load(memory_order_acquire) == 0){
+      if (d->owned){
+        delete[] d->frames;
+      }
+      delete d;
+    } else {
+      (*retired)[kept++] = d;
+    }
+  }
+  retired->resize(kept);
+}
@@ -0,0 +1,53 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Reference counted sample audio shared between the control & audio threads.
+///
+/// Audio is immutable once shared. Any thread may take & drop references
+/// without locks, but only the owner (control) thread frees: references it
+/// drops are put on a retired list, and data on that list is freed once no
+/// voice or event refers to it anymore. The audio thread never frees memory.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef SAMPLE_DATA_H
+#define SAMPLE_DATA_H
+
+#include <atomic>
+#include <vector>
+#include <soundtouch/STTypes.h>
+
+struct sample_data {
+  // interleaved frames, freed with the data unless borrowed
+  soundtouch::SAMPLETYPE *frames;
+  bool owned;
+  unsigned int channels;
+  long int nframes;
+
+  std::atomic_int refs;
+
+  // on the retired list of the owner thread
+  bool retired;
+};
+
+/// Wraps 'frames', allocated with new[], with a single reference
+sample_data *sample_data_new(soundtouch::SAMPLETYPE *frames, unsigned int channels,
+    long int nframes);
+
+/// Wraps 'frames' owned by someone else, e.g. a mapped file, with a single
+/// reference. The frames must outlive the data
+sample_data *sample_data_borrow(const soundtouch::SAMPLETYPE *frames, unsigned int channels,
+    long int nframes);
+
+/// Takes another reference, from any thread
+void sample_data_ref(sample_data *d);
+
+/// Drops a reference, from any thread. Never frees
+void sample_data_unref(sample_data *d);
+
+/// Drops a reference of the owner thread, data is freed by a later reclaim
+void sample_data_release(std::vector<sample_data *> *retired, sample_data *d);
+
+/// Frees retired data that is no longer referenced. Owner thread only
+void sample_data_reclaim(std::vector<sample_data *> *retired);
+
+#endif
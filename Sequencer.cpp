@@ -0,0 +1,98 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Step sequencer clocked by sample frames.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+
+#include "Sequencer.h"
+
+
+void seq_start(sequencer *seq)
+{
+  seq->step = 0;
+  seq->next_frame = 0;
+  seq->frames_per_step = 0;
+}
+
+int seq_advance(sequencer *seq, const seq_pattern * const *patterns, int num_patterns,
+    float bpm, float swing, unsigned int rate, int frames, seq_trigger *out, int max)
+{
+  int n = 0;
+
+  seq->frames_per_step = rate * 60.0 / (bpm * SEQ_STEPS_PER_BEAT);
+  while (1){
+    double t = seq->next_frame;
+    if (seq->step & 1){
+      t += swing * seq->frames_per_step;
+    }
+    if ((t >= frames) || (n + num_patterns * SEQ_LANES > max)){
+      break;
+    }
+
+    int offset = (t > 0) ? (int)t : 0;
+    for (int i = 0; i < num_patterns; i++){
+      const seq_pattern *p = patterns[i];
+      if ((p == NULL) || (p->length <= 0)){
+        continue;
+      }
+      int step = seq->step % p->length;
+      for (int lane = 0; lane < SEQ_LANES; lane++){
+        if (p->velocity[step][lane] == 0){
+          continue;
+        }
+        seq_trigger *tr = &out[n++];
+        tr->channel = p->channel;
+        tr->note = p->note[lane];
+        tr->velocity = p->velocity[step][lane];
+        tr->step = step;
+        tr->offset = offset;
+      }
+    }
+    seq->step++;
+    seq->next_frame += seq->frames_per_step;
+  }
+
+  // steps played late don't shift the following ones
+  seq->next_frame -= frames;
+  return n;
+}
+
+double seq_position(const sequencer *seq)
+{
+  if (seq->frames_per_step <= 0){
+    return 0;
+  }
+  return seq->step - seq->next_frame / seq->frames_per_step;
+}
+
+void seq_clear(seq_pattern *p, int channel, int length)
+{
+  memset(p, 0, sizeof(*p));
+  p->channel = channel;
+  p->length = length;
+  for (int lane = 0; lane < SEQ_LANES; lane++){
+    p->note[lane] = -1;
+  }
+}
+
+bool seq_set_step(seq_pattern *p, int step, int note, int velocity)
+{
+  int free_lane = -1;
+  for (int lane = 0; lane < SEQ_LANES; lane++){
+    if (p->note[lane] == note){
+      p->velocity[step][lane] = velocity;
+      return true;
+    }
+    if ((p->note[lane] < 0) && (free_lane < 0)){
+      free_lane = lane;
+    }
+  }
+  if (free_lane < 0){
+    return false;
+  }
+  p->note[free_lane] = note;
+  p->velocity[step][free_lane] = velocity;
+  return true;
+}
@@ -0,0 +1,75 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Step sequencer clocked by sample frames.
+///
+/// Patterns hold a velocity per step & lane, each lane playing one note on
+/// the channel of its pattern. The sequencer is advanced by the mixer one
+/// period at a time and returns the triggers of the period with their frame
+/// offsets, so steps are sample accurate and can't drift against the output.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef SEQUENCER_H
+#define SEQUENCER_H
+
+// max steps of a pattern
+#define SEQ_MAX_STEPS 64
+// notes a pattern can play on one step
+#define SEQ_LANES 8
+// steps are 16th notes
+#define SEQ_STEPS_PER_BEAT 4
+
+struct seq_pattern {
+  int channel;
+  int length;
+  // note of each lane, -1 for unused lanes
+  int note[SEQ_LANES];
+  // velocity of each step & lane, 0 for no trigger
+  unsigned char velocity[SEQ_MAX_STEPS][SEQ_LANES];
+};
+
+struct seq_trigger {
+  int channel;
+  int note;
+  int velocity;
+  int step;
+  // frames into the period
+  int offset;
+};
+
+/// Playback position, owned by the thread advancing it
+struct sequencer {
+  // next step to play
+  unsigned int step;
+  // frames from the start of the period to the next step, unswung
+  double next_frame;
+  double frames_per_step;
+};
+
+/// Restarts from the first step at the start of the next period
+void seq_start(sequencer *seq);
+
+/// Advances the sequencer by one period of 'frames' frames
+/// \return number of triggers written to 'out'. Steps that don't fit into
+/// 'max' are played late at the start of the next period
+int seq_advance(sequencer *seq,
+                const seq_pattern * const *patterns,  ///< Patterns, NULL for none
+                int num_patterns,
+                float bpm,
+                float swing,                          ///< Delay of odd steps, 0..0.5 steps
+                unsigned int rate,
+                int frames,
+                seq_trigger *out,
+                int max);
+
+/// Position at the end of the last period in steps, unswung
+double seq_position(const sequencer *seq);
+
+/// Clears steps & lanes of a pattern
+void seq_clear(seq_pattern *p, int channel, int length);
+
+/// Sets a step of the lane playing 'note', taking a free lane if there is none
+/// \return false if all lanes are in use
+bool seq_set_step(seq_pattern *p, int step, int note, int velocity);
+
+#endif
@@ -0,0 +1,195 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Streaming rate converter between the engine & an output device.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "StreamResampler.h"
+
+using namespace soundtouch;
+using namespace std;
+
+// Kaiser window shape & the cutoff relative to the lower Nyquist frequency,
+// the middle of the transition band
+#define STREAM_BETA 8.0
+#define STREAM_CUTOFF 0.91
+#define HALF_TAPS (STREAM_TAPS / 2)
+// drift loop bandwidth & the smoothing of the fill ahead of it, in Hz
+#define DRIFT_BANDWIDTH 0.02
+#define FILL_BANDWIDTH 0.2
+
+
+// zeroth order modified Bessel function of the first kind
+static double bessel_i0(double x)
+{
+  double sum = 1.0, term = 1.0;
+  for (int k = 1; k < 50; k++){
+    term *= (x / (2.0 * k)) * (x / (2.0 * k));
+    sum += term;
+    if (term < sum * 1e-12){
+      break;
+    }
+  }
+  return sum;
+}
+
+void stream_init(stream_resampler *r, unsigned int in_rate, unsigned int out_rate,
+    int channels, int max_input)
+{
+  r->channels = channels;
+  r->ratio = (double)in_rate / out_rate;
+  r->max_input = max_input;
+  r->period = max_input / r->ratio;
+  r->radians = 2 * M_PI * max_input / in_rate;
+
+  // one row per phase & one for the next frame, rows sum to unity
+  r->buffer = new float[(STREAM_PHASES + 1) * STREAM_TAPS + 4 +
+    channels * (STREAM_TAPS + max_input)];
+  r->table = (float *)(((uintptr_t)r->buffer + 15) & ~(uintptr_t)15);
+  r->history = r->table + (STREAM_PHASES + 1) * STREAM_TAPS;
+
+  double cutoff = STREAM_CUTOFF * min(1.0, 1.0 / r->ratio);
+  double i0_beta = bessel_i0(STREAM_BETA);
+  for (int p = 0; p <= STREAM_PHASES; p++){
+    double f = p / (double)STREAM_PHASES;
+    double h[STREAM_TAPS];
+    double sum = 0;
+    for (int k = 0; k < STREAM_TAPS; k++){
+      double x = k - (HALF_TAPS - 1) - f;
+      double s = (x == 0) ? 1.0 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+      double w = x / HALF_TAPS;
+      h[k] = s * ((fabs(w) >= 1) ? 0 : bessel_i0(STREAM_BETA * sqrt(1.0 - w * w)) / i0_beta);
+      sum += h[k];
+    }
+    for (int k = 0; k < STREAM_TAPS; k++){
+      r->table[p * STREAM_TAPS + k] = (float)(h[k] / sum);
+    }
+  }
+  stream_reset(r);
+}
+
+void stream_free(stream_resampler *r)
+{
+  delete[] r->buffer;
+  r->buffer = NULL;
+}
+
+void stream_reset(stream_resampler *r)
+{
+  // the first input frame is centred under the filter after half of it
+  memset(r->history, 0, r->channels * (STREAM_TAPS + r->max_input) * sizeof(float));
+  r->held = HALF_TAPS - 1;
+  r->pos = HALF_TAPS - 1;
+  r->frac = 0;
+  r->step = r->ratio;
+  r->error = 0;
+  r->drift = 0;
+}
+
+int stream_max_output(const stream_resampler *r, int frames)
+{
+  return (int)ceil(frames / (r->ratio * (1 - STREAM_MAX_DRIFT))) + 1;
+}
+
+int stream_process(stream_resampler *r, const SAMPLETYPE *in, int frames, SAMPLETYPE *out)
+{
+  int len = STREAM_TAPS + r->max_input;
+  int ch = r->channels;
+  frames = min(frames, r->max_input);
+  for (int c = 0; c < ch; c++){
+    float *h = r->history + c * len + r->held;
+    for (int i = 0; i < frames; i++){
+      h[i] = in[i * ch + c];
+    }
+  }
+  r->held += frames;
+
+  alignas(16) float kernel[STREAM_TAPS];
+  int got = 0;
+  while (r->pos + HALF_TAPS < r->held){
+    // taps between the two nearest phases
+    double p = r->frac * STREAM_PHASES;
+    int phase = (int)p;
+    float a = (float)(p - phase);
+    const float *t0 = r->table + phase * STREAM_TAPS;
+    const float *t1 = t0 + STREAM_TAPS;
+    const float *x = r->history + r->pos - (HALF_TAPS - 1);
+#ifdef __SSE__
+    __m128 va = _mm_set1_ps(a);
+    for (int k = 0; k < STREAM_TAPS; k += 4){
+      __m128 v0 = _mm_load_ps(t0 + k);
+      _mm_store_ps(kernel + k, _mm_add_ps(v0, _mm_mul_ps(va, _mm_sub_ps(_mm_load_ps(t1 + k), v0))));
+    }
+    for (int c = 0; c < ch; c++){
+      const float *xc = x + c * len;
+      __m128 acc = _mm_mul_ps(_mm_loadu_ps(xc), _mm_load_ps(kernel));
+      for (int k = 4; k < STREAM_TAPS; k += 4){
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(xc + k), _mm_load_ps(kernel + k)));
+      }
+      acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+      acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+      _mm_store_ss(&out[got * ch + c], acc);
+    }
+#else
+    for (int k = 0; k < STREAM_TAPS; k++){
+      kernel[k] = t0[k] + a * (t1[k] - t0[k]);
+    }
+    for (int c = 0; c < ch; c++){
+      const float *xc = x + c * len;
+      float y = 0;
+      for (int k = 0; k < STREAM_TAPS; k++){
+        y += kernel[k] * xc[k];
+      }
+      out[got * ch + c] = y;
+    }
+#endif
+    got++;
+
+    r->frac += r->step;
+    int whole = (int)r->frac;
+    r->pos += whole;
+    r->frac -= whole;
+  }
+
+  // keep the frames the next outputs still reach back to
+  int drop = r->pos - (HALF_TAPS - 1);
+  for (int c = 0; c < ch; c++){
+    float *h = r->history + c * len;
+    memmove(h, h + drop, (r->held - drop) * sizeof(float));
+  }
+  r->held -= drop;
+  r->pos -= drop;
+  return got;
+}
+
+void stream_track(stream_resampler *r, long int queued, long int target)
+{
+  // fill error in periods, smoothed. A device too full gets fewer frames,
+  // more input is taken for each output frame
+  double fill = (queued - target) / r->period;
+  r->error += FILL_BANDWIDTH * r->radians * (fill - r->error);
+
+  // loop gains of a critically damped loop at the bandwidth, relative to
+  // the period rate
+  double omega = DRIFT_BANDWIDTH * r->radians;
+  double b = sqrt(2.0) * omega;
+  double c = omega * omega;
+
+  r->drift = max(-STREAM_MAX_DRIFT, min(STREAM_MAX_DRIFT, r->drift + c * r->error));
+  double steer = max(-STREAM_MAX_DRIFT, min(STREAM_MAX_DRIFT, r->drift + b * r->error));
+  r->step = r->ratio * (1 + steer);
+}
+
+double stream_drift_ppm(const stream_resampler *r)
+{
+  return (r->step / r->ratio - 1) * 1e6;
+}
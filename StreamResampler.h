@@ -0,0 +1,83 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Streaming rate converter between the engine & an output device.
+///
+/// Converts a period at a time with a windowed sinc of STREAM_TAPS frames,
+/// its phases precomputed for a fixed ratio & interpolated between, so the
+/// ratio can be steered by tiny amounts while running. Conversion delays by
+/// half the filter, STREAM_TAPS / 2 input frames. Images & aliases are
+/// some 85 dB down across the pass band & a stereo frame costs about 55 ns
+/// with SSE on a desktop x86.
+///
+/// A device on its own clock consumes frames at a slightly different rate
+/// than the engine produces them. A second order loop like the one tracking
+/// midi clock watches the frames queued in the device & steers the ratio to
+/// keep them around a target, which cancels the drift of the two clocks.
+/// The fill is read once per period & is coarse, it is smoothed over about a
+/// second so the steering doesn't modulate the pitch.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef STREAM_RESAMPLER_H
+#define STREAM_RESAMPLER_H
+
+#include <soundtouch/STTypes.h>
+
+// filter length in input frames & phases of the table
+#define STREAM_TAPS 64
+#define STREAM_PHASES 256
+// max steering away from the nominal ratio, clocks are closer than this
+#define STREAM_MAX_DRIFT 0.005
+
+struct stream_resampler {
+  int channels;
+  // input frames per output frame, nominal & steered
+  double ratio;
+  double step;
+  // read position in the history & its fraction
+  long int pos;
+  double frac;
+  // STREAM_PHASES + 1 rows of filter taps, 16-byte aligned
+  float *table;
+  // planar input of each channel, the last frames of the previous period
+  // ahead of the current one
+  float *history;
+  int held;
+  int max_input;
+  float *buffer;
+
+  // drift loop: radians of 1 Hz over a period, output frames of a period,
+  // smoothed fill error in periods & the integrated correction of the ratio
+  double radians;
+  double period;
+  double error;
+  double drift;
+};
+
+/// Sets up conversion of 'channels' interleaved channels from 'in_rate' to
+/// 'out_rate', at most 'max_input' frames at a time. Allocates, not to be
+/// called from the audio thread
+void stream_init(stream_resampler *r, unsigned int in_rate, unsigned int out_rate,
+    int channels, int max_input);
+
+void stream_free(stream_resampler *r);
+
+/// Forgets the input so far & the steering, e.g. after an underrun
+void stream_reset(stream_resampler *r);
+
+/// \return most output frames for 'frames' input frames at any steering
+int stream_max_output(const stream_resampler *r, int frames);
+
+/// Converts 'frames' interleaved input frames to 'out'
+/// \return output frames written
+int stream_process(stream_resampler *r, const soundtouch::SAMPLETYPE *in, int frames,
+    soundtouch::SAMPLETYPE *out);
+
+/// Steers the ratio toward keeping 'target' frames queued in the device, once
+/// a period after writing, given 'queued' frames are waiting to be played
+void stream_track(stream_resampler *r, long int queued, long int target);
+
+/// \return steering of the ratio in parts per million
+double stream_drift_ppm(const stream_resampler *r);
+
+#endif
@@ -0,0 +1,187 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Varispeed reader: plays a region of a sample buffer at a fractional speed,
+/// interpolating between its frames.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "Varispeed.h"
+
+using namespace soundtouch;
+using namespace std;
+
+// Kaiser window shape of the sinc filter & its cutoff relative to Nyquist
+#define SINC_BETA 6.0
+#define SINC_CUTOFF 0.9
+// frames before & after the read position used by the widest kernel
+#define TAPS_BEFORE (SINC_TAPS / 2 - 1)
+#define TAPS_AFTER (SINC_TAPS / 2)
+// the position steps in 32.32 fixed point, keeping float conversions off the
+// dependency chain from one frame to the next
+#define FRAC_ONE 4294967296.0
+#define PHASE_SHIFT 23
+
+// one row per phase & one for the next frame, rows sum to unity
+static float sinc_table[SINC_PHASES + 1][SINC_TAPS];
+#ifdef __SSE__
+// taps doubled for interleaved stereo, 16-byte aligned rows
+alignas(16) static float sinc_table2[SINC_PHASES + 1][2 * SINC_TAPS];
+#endif
+
+
+// zeroth order modified Bessel function of the first kind
+static double bessel_i0(double x)
+{
+  double sum = 1.0, term = 1.0;
+  for (int k = 1; k < 50; k++){
+    term *= (x / (2.0 * k)) * (x / (2.0 * k));
+    sum += term;
+    if (term < sum * 1e-12){
+      break;
+    }
+  }
+  return sum;
+}
+
+void varispeed_init()
+{
+  double i0_beta = bessel_i0(SINC_BETA);
+  double half = SINC_TAPS / 2.0;
+  for (int p = 0; p <= SINC_PHASES; p++){
+    double f = p / (double)SINC_PHASES;
+    double sum = 0;
+    double h[SINC_TAPS];
+    for (int k = 0; k < SINC_TAPS; k++){
+      double x = k - TAPS_BEFORE - f;
+      double s = (x == 0) ? 1.0 : sin(M_PI * SINC_CUTOFF * x) / (M_PI * SINC_CUTOFF * x);
+      double r = x / half;
+      double w = (fabs(r) >= 1) ? 0 : bessel_i0(SINC_BETA * sqrt(1.0 - r * r)) / i0_beta;
+      h[k] = s * w;
+      sum += h[k];
+    }
+    for (int k = 0; k < SINC_TAPS; k++){
+      sinc_table[p][k] = (float)(h[k] / sum);
+#ifdef __SSE__
+      sinc_table2[p][2*k] = sinc_table2[p][2*k+1] = sinc_table[p][k];
+#endif
+    }
+  }
+}
+
+// interpolates channel 'c' at 'f' past frame 'p' of CH channel frames,
+// 'phase' is the nearest sinc phase of 'f'
+template<int CH, interp_type T>
+static inline float kernel(const SAMPLETYPE *p, int c, float f, int phase)
+{
+  if (T == INTERP_LINEAR){
+    float a = p[c], b = p[CH + c];
+    return a + f * (b - a);
+  }
+  if (T == INTERP_CUBIC){
+    float y0 = p[-CH + c], y1 = p[c], y2 = p[CH + c], y3 = p[2*CH + c];
+    float a = 1.5f * (y1 - y2) + 0.5f * (y3 - y0);
+    float b = y0 - 2.5f * y1 + 2 * y2 - 0.5f * y3;
+    float d = 0.5f * (y2 - y0);
+    return ((a * f + b) * f + d) * f + y1;
+  }
+  const float *h = sinc_table[phase];
+  const SAMPLETYPE *x = p - TAPS_BEFORE * CH + c;
+  float y = 0;
+  for (int k = 0; k < SINC_TAPS; k++){
+    y += h[k] * x[k * CH];
+  }
+  return y;
+}
+
+template<int CH, interp_type T>
+static int read(const SAMPLETYPE *in, long int first, long int end, long int *pos,
+    float *frac, float speed, SAMPLETYPE *out, int frames)
+{
+  // frames around the edges are gathered into a window of clamped frames
+  SAMPLETYPE window[SINC_TAPS * CH];
+  long int p = *pos;
+  uint64_t f = (uint64_t)(*frac * FRAC_ONE);
+  uint64_t step = (uint64_t)(speed * FRAC_ONE);
+  int got = 0;
+  // a fraction rounded up to one when stored
+  p += (long int)(f >> 32);
+  f &= 0xffffffffu;
+
+  for (; (got < frames) && (p < end); got++){
+    const SAMPLETYPE *x;
+    if ((p - TAPS_BEFORE >= first) && (p + TAPS_AFTER < end)){
+      x = in + p * CH;
+    } else {
+      for (int k = 0; k < SINC_TAPS; k++){
+        long int i = max(first, min(end - 1, p + k - TAPS_BEFORE));
+        for (int c = 0; c < CH; c++){
+          window[k * CH + c] = in[i * CH + c];
+        }
+      }
+      x = window + TAPS_BEFORE * CH;
+    }
+
+    float ff = (float)(uint32_t)f * (float)(1.0 / FRAC_ONE);
+    int phase = (int)((f + (1u << (PHASE_SHIFT - 1))) >> PHASE_SHIFT);
+#ifdef __SSE__
+    // both channels of a stereo sinc in one pass, pairs of frames at a time
+    if ((CH == 2) && (T == INTERP_SINC)){
+      const float *h = sinc_table2[phase];
+      const SAMPLETYPE *w = x - TAPS_BEFORE * 2;
+      __m128 acc = _mm_mul_ps(_mm_loadu_ps(w), _mm_load_ps(h));
+      for (int k = 4; k < 2 * SINC_TAPS; k += 4){
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(w + k), _mm_load_ps(h + k)));
+      }
+      acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+      _mm_storel_pi((__m64 *)&out[2*got], acc);
+    } else
+#endif
+    {
+      float l = kernel<CH, T>(x, 0, ff, phase);
+      out[2*got] = l;
+      out[2*got+1] = (CH == 1) ? l : kernel<CH, T>(x, 1, ff, phase);
+    }
+
+    f += step;
+    p += (long int)(f >> 32);
+    f &= 0xffffffffu;
+  }
+
+  *pos = min(p, end);
+  *frac = (float)(f * (1.0 / FRAC_ONE));
+  return got;
+}
+
+template<int CH>
+static int read_channels(const SAMPLETYPE *in, long int first, long int end,
+    long int *pos, float *frac, float speed, interp_type type, SAMPLETYPE *out, int frames)
+{
+  switch (type){
+    case INTERP_LINEAR:
+      return read<CH, INTERP_LINEAR>(in, first, end, pos, frac, speed, out, frames);
+    case INTERP_CUBIC:
+      return read<CH, INTERP_CUBIC>(in, first, end, pos, frac, speed, out, frames);
+    case INTERP_SINC:
+      break;
+  }
+  return read<CH, INTERP_SINC>(in, first, end, pos, frac, speed, out, frames);
+}
+
+int varispeed_read(const SAMPLETYPE *in, int channels, long int first,
+    long int end, long int *pos, float *frac, float speed, interp_type type,
+    SAMPLETYPE *out, int frames)
+{
+  speed = max(VARISPEED_MIN, min(VARISPEED_MAX, speed));
+  if (channels == 1){
+    return read_channels<1>(in, first, end, pos, frac, speed, type, out, frames);
+  }
+  return read_channels<2>(in, first, end, pos, frac, speed, type, out, frames);
+}
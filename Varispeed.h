@@ -0,0 +1,40 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Varispeed reader: plays a region of a sample buffer at a fractional speed,
+/// interpolating between its frames.
+///
+/// Frames are read straight from the contiguous sample buffer, there is no
+/// buffering or latency. Interpolation is linear (2 frames), cubic (4 frame
+/// Catmull-Rom) or windowed sinc (8 frames), the sinc filter is precomputed
+/// as a table of phases so a frame costs a short dot product per channel.
+/// The sinc cutoff is fixed, speeds above 1 alias like the other kinds.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef VARISPEED_H
+#define VARISPEED_H
+
+#include <soundtouch/STTypes.h>
+
+// range of playback speed
+#define VARISPEED_MIN 0.01f
+#define VARISPEED_MAX 8.0f
+// frames of the sinc filter & phases of the table
+#define SINC_TAPS 8
+#define SINC_PHASES 512
+
+enum interp_type{INTERP_LINEAR, INTERP_CUBIC, INTERP_SINC};
+
+/// Builds the sinc table, before any reader runs
+void varispeed_init();
+
+/// Reads at most 'frames' stereo frames from region [first, end[ of 'in', of
+/// 1 or 2 channels, into 'out'. Reading starts at frame '*pos' plus '*frac' &
+/// moves on 'speed' frames per frame, both are advanced. Frames around the
+/// edges of the region are taken as the edge frames
+/// \return frames read, fewer than 'frames' once the end is passed
+int varispeed_read(const soundtouch::SAMPLETYPE *in, int channels, long int first,
+    long int end, long int *pos, float *frac, float speed, interp_type type,
+    soundtouch::SAMPLETYPE *out, int frames);
+
+#endif
@@ -0,0 +1,416 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Sampler voices: amplitude envelopes, gain ramped mixing and rendering of a
+/// sample region through a per-voice SoundTouch processor.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+#include <algorithm>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "Voice.h"
+
+using namespace soundtouch;
+using namespace std;
+
+
+// per frame step covering full scale in 'seconds', instant if zero
+static float env_step(float seconds, unsigned int rate)
+{
+  float frames = seconds * rate;
+  return (frames < 1.0f) ? 1.0f : 1.0f / frames;
+}
+
+void env_start(envelope *env, const adsr *a, unsigned int rate)
+{
+  env->stage = ENV_ATTACK;
+  env->level = 0;
+  env->attack_step = env_step(a->attack, rate);
+  env->decay_step = env_step(a->decay, rate);
+  env->sustain = a->sustain;
+  env->release_step = env_step(a->release, rate);
+}
+
+void env_release(envelope *env)
+{
+  if (env->stage != ENV_IDLE){
+    env->stage = ENV_RELEASE;
+  }
+}
+
+void env_fade(envelope *env, float seconds, unsigned int rate)
+{
+  if (env->stage == ENV_IDLE){
+    return;
+  }
+  // steps are for full scale, so a quieter voice fades out sooner
+  float step = env_step(seconds, rate);
+  if ((env->stage != ENV_RELEASE) || (step > env->release_step)){
+    env->release_step = step;
+  }
+  env->stage = ENV_RELEASE;
+}
+
+float env_advance(envelope *env, int frames)
+{
+  float n = (float)frames;
+
+  // a stage boundary inside the block continues in the next stage
+  while (n > 0){
+    switch (env->stage){
+      case ENV_ATTACK: {
+        float left = (1.0f - env->level) / env->attack_step;
+        if (left > n){
+          env->level += n * env->attack_step;
+          return env->level;
+        }
+        n -= left;
+        env->level = 1.0f;
+        env->stage = ENV_DECAY;
+        break;
+      }
+      case ENV_DECAY: {
+        float left = (env->level - env->sustain) / env->decay_step;
+        if (left > n){
+          env->level -= n * env->decay_step;
+          return env->level;
+        }
+        n -= left;
+        env->level = env->sustain;
+        env->stage = ENV_SUSTAIN;
+        break;
+      }
+      case ENV_SUSTAIN:
+        return env->level;
+      case ENV_RELEASE: {
+        env->level -= n * env->release_step;
+        if (env->level <= 0){
+          env->level = 0;
+          env->stage = ENV_IDLE;
+        }
+        return env->level;
+      }
+      case ENV_IDLE:
+        return 0;
+    }
+  }
+  return env->level;
+}
+
+void mix_ramp(float *dst, const float *src, int frames, float g0, float g1)
+{
+  float dg = (g1 - g0) / frames;
+  int i = 0;
+
+#ifdef __SSE__
+  // two stereo frames per step
+  __m128 g = _mm_setr_ps(g0, g0, g0 + dg, g0 + dg);
+  __m128 step = _mm_set1_ps(2 * dg);
+  for (; i + 2 <= frames; i += 2){
+    __m128 d = _mm_loadu_ps(dst + 2*i);
+    __m128 s = _mm_loadu_ps(src + 2*i);
+    _mm_storeu_ps(dst + 2*i, _mm_add_ps(d, _mm_mul_ps(s, g)));
+    g = _mm_add_ps(g, step);
+  }
+#endif
+  for (; i < frames; i++){
+    float g = g0 + i * dg;
+    dst[2*i] += src[2*i] * g;
+    dst[2*i+1] += src[2*i+1] * g;
+  }
+}
+
+void voice_start(voice *v, voice_mode mode, sample_data *audio, long int start,
+    long int end, float gain, const adsr *a, unsigned int rate)
+{
+  // a stolen voice still refers to the audio it was playing
+  sample_data_ref(audio);
+  if (v->audio != NULL){
+    sample_data_unref(v->audio);
+  }
+  v->mode = mode;
+  v->audio = audio;
+  v->start = start;
+  v->pos = start;
+  v->end = end;
+  v->heard = start;
+  v->frac = 0;
+  v->speed = 1.0f;
+  if (v->head != NULL){
+    sample_data_unref(v->head);
+    v->head = NULL;
+  }
+  v->head_pos = 0;
+  v->primed = 0;
+  v->warmup = -1;
+  v->warm = (mode != VOICE_STRETCH);
+  v->interp = INTERP_CUBIC;
+  v->transpose = 0;
+  v->gain = gain;
+  v->draining = false;
+  v->delay = 0;
+
+  // fade out ends at end of region instead of cutting
+  v->release_pos = max(start, end - (long int)(a->release * rate));
+
+  env_start(&v->env, a, rate);
+  if (mode == VOICE_STRETCH){
+    v->st.clear();
+  }
+  v->active = true;
+}
+
+void voice_set_head(voice *v, sample_data *head)
+{
+  sample_data_ref(head);
+  v->head = head;
+  v->warm = true;
+}
+
+void voice_release(voice *v)
+{
+  env_release(&v->env);
+}
+
+void voice_choke(voice *v, float seconds, unsigned int rate)
+{
+  env_fade(&v->env, seconds, rate);
+}
+
+void voice_prewarm(voice *v, float tempo_change, float pitch_semitones, float rate_change)
+{
+  v->st.setTempoChange(tempo_change);
+  v->st.setPitchSemiTones(pitch_semitones);
+  v->st.setRateChange(rate_change);
+
+  memset(v->in, 0, sizeof(v->in));
+  for (int i = 0; i < VOICE_MAX_FRAMES / VOICE_FEED_FRAMES * 4; i++){
+    v->st.putSamples(v->in, VOICE_FEED_FRAMES);
+    while (v->st.receiveSamples(v->out, VOICE_MAX_FRAMES) > 0){
+    }
+  }
+  v->st.flush();
+  while (v->st.receiveSamples(v->out, VOICE_MAX_FRAMES) > 0){
+  }
+  v->st.clear();
+}
+
+// feed next block of a region to SoundTouch through 'in', flushing it at end
+// of region
+// \return false once flushed
+static bool feed(SoundTouch *st, const sample_data *audio, long int *pos, long int end,
+    SAMPLETYPE *in)
+{
+  long int n = min((long int)VOICE_FEED_FRAMES, end - *pos);
+  if (n <= 0){
+    st->flush();
+    return false;
+  }
+
+  if (audio->channels == 1){
+    const SAMPLETYPE *src = &audio->frames[*pos];
+    for (long int i = 0; i < n; i++){
+      in[2*i] = in[2*i+1] = src[i];
+    }
+  } else {
+    memcpy(in, &audio->frames[*pos * VOICE_CHANNELS], n * VOICE_CHANNELS * sizeof(SAMPLETYPE));
+  }
+  st->putSamples(in, (uint)n);
+  *pos += n;
+  return true;
+}
+
+static void voice_feed(voice *v)
+{
+  v->draining = !feed(&v->st, v->audio, &v->pos, v->end, v->in);
+}
+
+long int voice_render_head(SoundTouch *st, const sample_data *audio,
+    long int start, long int end, SAMPLETYPE *out, long int frames)
+{
+  SAMPLETYPE in[VOICE_FEED_FRAMES * VOICE_CHANNELS];
+  long int pos = start;
+  long int got = 0;
+  bool draining = false;
+
+  st->clear();
+  while (got < frames){
+    if (st->numSamples() == 0){
+      if (draining){
+        break;
+      }
+      draining = !feed(st, audio, &pos, end, in);
+      continue;
+    }
+    got += st->receiveSamples(&out[got * VOICE_CHANNELS], (uint)(frames - got));
+  }
+  return got;
+}
+
+// processor output the head covers is dropped as it comes, at most 'budget'
+// input frames are fed for it
+static void catch_up(voice *v, long int budget)
+{
+  long int fed = 0;
+  while ((v->primed < v->head->nframes) && (fed < budget)){
+    if (v->st.numSamples() == 0){
+      if (v->draining){
+        break;
+      }
+      voice_feed(v);
+      fed += VOICE_FEED_FRAMES;
+      continue;
+    }
+    // the input scratch is free once fed
+    uint n = (uint)min((long int)VOICE_FEED_FRAMES, v->head->nframes - v->primed);
+    v->primed += v->st.receiveSamples(v->in, n);
+  }
+}
+
+// head frames into the scratch while the processor catches up, within the
+// feed budget of a render. Once the head is played the processor takes over
+// from where it is. If it is still behind, e.g. at a high tempo, '*fade' is
+// set to the last frames of the head to cross-fade into its output
+static int play_head(voice *v, int frames, int *fade)
+{
+  sample_data *h = v->head;
+  int n = (int)min((long int)frames, h->nframes - v->head_pos);
+  memcpy(v->out, &h->frames[v->head_pos * VOICE_CHANNELS], n * VOICE_CHANNELS * sizeof(SAMPLETYPE));
+  v->head_pos += n;
+
+  catch_up(v, VOICE_PRIME_FEED_FRAMES);
+  *fade = 0;
+  if (v->head_pos == h->nframes){
+    if (v->primed < h->nframes){
+      *fade = min(n, VOICE_XFADE_FRAMES);
+    }
+    sample_data_unref(h);
+    v->head = NULL;
+  }
+  return n;
+}
+
+// SoundTouch output of the region into the scratch
+static int render_stretch(voice *v, int frames)
+{
+  int got = 0;
+  int fade = 0;
+  SAMPLETYPE tail[VOICE_XFADE_FRAMES * VOICE_CHANNELS];
+  if (v->head != NULL){
+    got = play_head(v, frames, &fade);
+    // processor output is written over the fading frames
+    got -= fade;
+    memcpy(tail, &v->out[got * VOICE_CHANNELS], fade * VOICE_CHANNELS * sizeof(SAMPLETYPE));
+  }
+  int faded = got;
+  while (got < frames){
+    if (v->st.numSamples() == 0){
+      if (v->draining){
+        break;
+      }
+      voice_feed(v);
+      continue;
+    }
+    got += v->st.receiveSamples(&v->out[got * VOICE_CHANNELS], frames - got);
+  }
+  for (int i = 0; i < fade; i++){
+    SAMPLETYPE *o = &v->out[(faded + i) * VOICE_CHANNELS];
+    if (faded + i >= got){
+      // a region flushed before the end of the fade keeps the head
+      o[0] = tail[2*i];
+      o[1] = tail[2*i+1];
+      continue;
+    }
+    float a = (i + 1) / (float)(fade + 1);
+    o[0] = tail[2*i] + a * (o[0] - tail[2*i]);
+    o[1] = tail[2*i+1] + a * (o[1] - tail[2*i+1]);
+  }
+  got = max(got, faded + fade);
+  if (!v->warm && (got > 0)){
+    v->warm = true;
+    v->warmup = v->pos - v->start;
+  }
+  return got;
+}
+
+// region as it is, stereo audio is mixed straight from the sample
+static int read_direct(voice *v, int frames, const SAMPLETYPE **src)
+{
+  int got = (int)max(0L, min((long int)frames, v->end - v->pos));
+  if (v->audio->channels == 1){
+    const SAMPLETYPE *in = &v->audio->frames[v->pos];
+    for (int i = 0; i < got; i++){
+      v->out[2*i] = v->out[2*i+1] = in[i];
+    }
+  } else {
+    *src = &v->audio->frames[v->pos * VOICE_CHANNELS];
+  }
+  v->pos += got;
+  return got;
+}
+
+long int voice_heard_pos(const voice *v)
+{
+  return (long int)v->heard;
+}
+
+bool voice_render(voice *v, float *mix, int frames)
+{
+  int got = 0;
+  const SAMPLETYPE *src = v->out;
+
+  // started within the period
+  if (v->delay > 0){
+    int skip = min(v->delay, frames);
+    mix += skip * VOICE_CHANNELS;
+    frames -= skip;
+    v->delay -= skip;
+  }
+
+  switch (v->mode){
+    case VOICE_STRETCH:
+      got = render_stretch(v, frames);
+      break;
+    case VOICE_DIRECT:
+      got = read_direct(v, frames, &src);
+      break;
+    case VOICE_VARISPEED:
+      got = varispeed_read(v->audio->frames, v->audio->channels, v->start, v->end,
+          &v->pos, &v->frac, v->speed, v->interp, v->out, frames);
+      break;
+  }
+
+  // output of the processor is input played at its ratio
+  if (v->mode == VOICE_STRETCH){
+    v->heard = min((double)v->end, v->heard + got * v->st.getInputOutputSampleRatio());
+  } else {
+    v->heard = (double)v->pos;
+  }
+
+  if ((voice_heard_pos(v) >= v->release_pos) && (v->env.stage != ENV_RELEASE)){
+    env_release(&v->env);
+  }
+
+  // apply velocity & envelope gain while mixing
+  for (int off = 0; off < got; off += ENV_BLOCK_FRAMES){
+    int n = min(ENV_BLOCK_FRAMES, got - off);
+    float g0 = v->env.level * v->gain;
+    float g1 = env_advance(&v->env, n) * v->gain;
+    mix_ramp(mix + off * VOICE_CHANNELS, &src[off * VOICE_CHANNELS], n, g0, g1);
+  }
+
+  if ((got < frames) || (v->env.stage == ENV_IDLE)){
+    sample_data_unref(v->audio);
+    v->audio = NULL;
+    if (v->head != NULL){
+      sample_data_unref(v->head);
+      v->head = NULL;
+    }
+    v->active = false;
+  }
+  return v->active;
+}
@@ -0,0 +1,184 @@
+////////////////////////////////////////////////////////////////////////////////
+///
+/// Sampler voices: amplitude envelopes, gain ramped mixing and rendering of a
+/// sample region through a per-voice SoundTouch processor.
+///
+/// A stretched voice can start from a head of processor output made ahead of
+/// time. It plays the head while its own processor is fed a bounded number of
+/// frames per render, dropping the output the head already covered, so a
+/// trigger doesn't have to push the whole processing latency through
+/// SoundTouch in one period.
+///
+/// Voices that don't stretch skip SoundTouch: they either play the region as
+/// it is or read it at a fractional speed, changing pitch & tempo together
+/// like a tape machine.
+///
+/// All voice state is preallocated, rendering doesn't allocate memory.
+///
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef VOICE_H
+#define VOICE_H
+
+#include <soundtouch/SoundTouch.h>
+#include "SampleData.h"
+#include "Varispeed.h"
+
+// interleaved output channels
+#define VOICE_CHANNELS 2
+// max frames rendered by one call
+#define VOICE_MAX_FRAMES 1024
+// frames fed to SoundTouch at a time
+#define VOICE_FEED_FRAMES 256
+// frames fed per render while a voice catches up with its head
+#define VOICE_PRIME_FEED_FRAMES (4 * VOICE_FEED_FRAMES)
+// frames of a head cross-faded into processor output that hasn't caught up
+#define VOICE_XFADE_FRAMES 64
+// frames per envelope step, gain is ramped linearly in between
+#define ENV_BLOCK_FRAMES 32
+/// How a voice reads its region: through SoundTouch, as it is, or at a speed
+enum voice_mode {VOICE_STRETCH, VOICE_DIRECT, VOICE_VARISPEED};
+
+/// ADSR settings, times in seconds & sustain as level
+struct adsr {
+  float attack;
+  float decay;
+  float sustain;
+  float release;
+};
+
+enum env_stage {ENV_IDLE, ENV_ATTACK, ENV_DECAY, ENV_SUSTAIN, ENV_RELEASE};
+
+/// Linear segment envelope, steps are per frame
+struct envelope {
+  env_stage stage;
+  float level;
+  float attack_step;
+  float decay_step;
+  float sustain;
+  float release_step;
+};
+
+struct voice {
+  bool active;
+
+  // midi channel & note that triggered the voice
+  int channel;
+  int note;
+
+  // voices of the same group cut each other off
+  int choke_group;
+
+  // trigger order
+  unsigned int age;
+
+  // links of the voice list of its channel, oldest first
+  voice *prev;
+  voice *next;
+
+  voice_mode mode;
+
+  // referenced sample audio of 1 or VOICE_CHANNELS channels & region of it
+  sample_data *audio;
+  long int start;
+  long int pos;
+  long int end;
+
+  // varispeed position between 'pos' & the next frame, frames read per frame
+  // & interpolation
+  float frac;
+  float speed;
+  interp_type interp;
+
+  // semitones the note plays the region up or down
+  float transpose;
+
+  // release starts when playback reaches this frame
+  long int release_pos;
+
+  // frame of the region heard so far. Stretched voices feed their processor
+  // ahead of it, by its latency or by the head
+  double heard;
+
+  // frames of the next render before the voice starts
+  int delay;
+
+  // input consumed, SoundTouch is being flushed
+  bool draining;
+
+  // referenced head of processor output, frames of it played & frames of
+  // processor output dropped as the head covered them
+  sample_data *head;
+  long int head_pos;
+  long int primed;
+
+  // input frames fed before the first output of a start without a head, -1
+  // until then or once taken by the caller
+  long int warmup;
+  bool warm;
+
+  // tempo of the sample, 0 if unknown
+  float bpm;
+
+  // velocity gain
+  float gain;
+  envelope env;
+
+  // per voice processor & scratch
+  soundtouch::SoundTouch st;
+  soundtouch::SAMPLETYPE in[VOICE_FEED_FRAMES * VOICE_CHANNELS];
+  soundtouch::SAMPLETYPE out[VOICE_MAX_FRAMES * VOICE_CHANNELS];
+};
+
+/// Starts envelope attack from silence
+void env_start(envelope *env, const adsr *a, unsigned int rate);
+
+/// Enters release stage with the release time of the envelope
+void env_release(envelope *env);
+
+/// Enters release stage fading out in at most 'seconds'
+void env_fade(envelope *env, float seconds, unsigned int rate);
+
+/// Advances envelope by 'frames' frames
+/// \return level after advancing
+float env_advance(envelope *env, int frames);
+
+/// dst += src * gain for interleaved stereo, gain ramping from g0 to g1
+void mix_ramp(float *dst, const float *src, int frames, float g0, float g1);
+
+/// Starts playback of frames [start, end[ of given sample audio. The voice
+/// holds a reference to the audio until it has finished. Varispeed voices
+/// start at unity speed with cubic interpolation, untransposed
+void voice_start(voice *v, voice_mode mode, sample_data *audio, long int start,
+    long int end, float gain, const adsr *a, unsigned int rate);
+
+/// Starts a stretched voice from 'head', output of its region rendered at the
+/// settings of the voice by voice_render_head. Holds a reference to the head
+void voice_set_head(voice *v, sample_data *head);
+
+/// Renders up to 'frames' stereo frames of output of region [start, end[ of
+/// 'audio' through 'st', fed the way a voice feeds its processor. Clears the
+/// processor first
+/// \return frames rendered, fewer once the flushed region ran out
+long int voice_render_head(soundtouch::SoundTouch *st, const sample_data *audio,
+    long int start, long int end, soundtouch::SAMPLETYPE *out, long int frames);
+
+/// Releases the voice like a note off
+void voice_release(voice *v);
+
+/// Cuts the voice off with a short fade of 'seconds'
+void voice_choke(voice *v, float seconds, unsigned int rate);
+
+/// Runs silence through the SoundTouch processor of the voice with the given
+/// settings, so that its buffers have grown to their size at these settings
+/// before the voice is rendered by the audio thread. Leaves it cleared
+void voice_prewarm(voice *v, float tempo_change, float pitch_semitones, float rate_change);
+
+/// \return frame of the region heard so far
+long int voice_heard_pos(const voice *v);
+
+/// Renders 'frames' frames of the voice and mixes them into 'mix'
+/// \return false once the voice has finished
+bool voice_render(voice *v, float *mix, int frames);
+
+#endif
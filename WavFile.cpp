@@ -44,6 +44,8 @@
 #include <cstring>
 #include <assert.h>
 #include <limits.h>
+#include <algorithm>
+#include <unistd.h>
 
 #include "WavFile.h"
 #include <soundtouch/STTypes.h>
@@ -55,6 +57,13 @@ static const char waveStr[] = "WAVE";
 static const char fmtStr[]  = "fmt ";
 static const char factStr[] = "fact";
 static const char dataStr[] = "data";
+static const char cueStr[]  = "cue ";
+static const char smplStr[] = "smpl";
+static const char listStr[] = "LIST";
+
+// Tail of the KSDATAFORMAT_SUBTYPE_xxx GUIDs, the first two bytes carry the plain format tag
+static const unsigned char subFormatGuidTail[14] = 
+    {0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71};
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -227,6 +236,32 @@ void WavInFile::init()
         ST_THROW_RT_ERROR("Error: Illegal wav file header format parameters.");
     }
 
+    if ((formatTag != WAV_FORMAT_PCM) && 
+        ((formatTag != WAV_FORMAT_IEEE_FLOAT) || (header.format.bits_per_sample != 32)))
+    {
+        stringstream ss;
+        ss << "Error: Unsupported wav sample format 0x" << hex << formatTag;
+        ST_THROW_RT_ERROR(ss.str().c_str());
+    }
+
+    // don't trust data length of a truncated file beyond the actual file size
+    if (chunks.data.offset > 0)
+    {
+        readMarkers();
+
+        long fileSize;
+
+        fseek(fptr, 0, SEEK_END);
+        fileSize = ftell(fptr);
+        if ((fileSize >= chunks.data.offset) && 
+            ((unsigned long)(fileSize - chunks.data.offset) < header.data.data_len))
+        {
+            header.data.data_len = (uint)(fileSize - chunks.data.offset);
+            chunks.data.len = header.data.data_len;
+        }
+        seekData(0);
+    }
+
     dataRead = 0;
 }
 
@@ -240,12 +275,72 @@ WavInFile::~WavInFile()
 
 void WavInFile::rewind()
 {
-    int hdrsOk;
+    seekData(0);
+}
 
-    fseek(fptr, 0, SEEK_SET);
-    hdrsOk = readWavHeaders();
-    assert(hdrsOk == 0);
-    dataRead = 0;
+
+void WavInFile::seekData(long byteOffset)
+{
+    int res;
+
+    res = fseek(fptr, chunks.data.offset + byteOffset, SEEK_SET);
+    assert(res == 0);
+    dataRead = byteOffset;
+}
+
+
+void WavInFile::seekFrame(uint64_t frame)
+{
+    uint64_t byteOffset;
+
+    byteOffset = frame * header.format.byte_per_sample;
+    if (byteOffset > header.data.data_len) byteOffset = header.data.data_len;
+    seekData((long)byteOffset);
+}
+
+
+/// Positioned read that leaves the stream position untouched. Uses only stack
+/// memory so that any number of threads may call this concurrently.
+int WavInFile::readFrames(uint64_t offset, int count, float *buffer) const
+{
+    // raw block, padded for the 4-byte loads of 24bit conversion
+    char temp[READ_BLOCK_SIZE + 4];
+    uint bytesPerFrame;
+    uint64_t byteOffset, byteEnd;
+    int fd, framesPerBlock, framesRead;
+
+    assert(buffer);
+    bytesPerFrame = header.format.byte_per_sample;
+    framesPerBlock = READ_BLOCK_SIZE / bytesPerFrame;
+    fd = fileno(fptr);
+
+    // Don't read more samples than are marked available in header
+    byteOffset = offset * bytesPerFrame;
+    byteEnd = byteOffset + (uint64_t)count * bytesPerFrame;
+    if (byteEnd > header.data.data_len) byteEnd = header.data.data_len;
+
+    framesRead = 0;
+    while (byteOffset < byteEnd)
+    {
+        ssize_t numBytes;
+        int numFrames;
+
+        numFrames = (int)((byteEnd - byteOffset) / bytesPerFrame);
+        if (numFrames > framesPerBlock) numFrames = framesPerBlock;
+        if (numFrames == 0) break;
+
+        numBytes = pread(fd, temp, numFrames * bytesPerFrame, chunks.data.offset + (off_t)byteOffset);
+        if (numBytes <= 0) break;   // read error or unexpected eof
+        numFrames = (int)(numBytes / bytesPerFrame);
+
+        convertToFloat(temp, buffer + (uint64_t)framesRead * header.format.channel_number,
+                       numFrames * header.format.channel_number);
+        framesRead += numFrames;
+        byteOffset += numFrames * bytesPerFrame;
+        if ((uint)numBytes % bytesPerFrame) break;
+    }
+
+    return framesRead;
 }
 
 
@@ -351,49 +446,14 @@ int WavInFile::read(short *buffer, int maxElems)
 }
 
 
-/// Read data in float format. Notice that when reading in float format 
-/// 8/16/24/32 bit sample formats are supported
-int WavInFile::read(float *buffer, int maxElems)
+/// Converts raw sample data of the file's format to float
+void WavInFile::convertToFloat(const char *temp, float *buffer, int numElems) const
 {
-    unsigned int afterDataRead;
-    int numBytes;
-    int numElems;
-    int bytesPerSample;
-
-    assert(buffer);
-
-    bytesPerSample = header.format.bits_per_sample / 8;
-    if ((bytesPerSample < 1) || (bytesPerSample > 4))
-    {
-        stringstream ss;
-        ss << "\nOnly 8/16/24/32 bit sample WAV files supported. Can't open WAV file with ";
-        ss << (int)header.format.bits_per_sample;
-        ss << " bit sample format. ";
-        ST_THROW_RT_ERROR(ss.str().c_str());
-    }
-
-    numBytes = maxElems * bytesPerSample;
-    afterDataRead = dataRead + numBytes;
-    if (afterDataRead > header.data.data_len) 
-    {
-        // Don't read more samples than are marked available in header
-        numBytes = (int)header.data.data_len - (int)dataRead;
-        assert(numBytes >= 0);
-    }
-
-    // read raw data into temporary buffer
-    char *temp = (char*)getConvBuffer(numBytes);
-    numBytes = (int)fread(temp, 1, numBytes, fptr);
-    dataRead += numBytes;
-
-    numElems = numBytes / bytesPerSample;
-
-    // swap byte ordert & convert to float, depending on sample format
-    switch (bytesPerSample)
+    switch (header.format.bits_per_sample / 8)
     {
         case 1:
         {
-            unsigned char *temp2 = (unsigned char*)temp;
+            const unsigned char *temp2 = (const unsigned char*)temp;
             double conv = 1.0 / 128.0;
             for (int i = 0; i < numElems; i ++)
             {
@@ -404,7 +464,7 @@ int WavInFile::read(float *buffer, int maxElems)
 
         case 2:
         {
-            short *temp2 = (short*)temp;
+            const short *temp2 = (const short*)temp;
             double conv = 1.0 / 32768.0;
             for (int i = 0; i < numElems; i ++)
             {
@@ -416,11 +476,11 @@ int WavInFile::read(float *buffer, int maxElems)
 
         case 3:
         {
-            char *temp2 = (char *)temp;
+            const char *temp2 = temp;
             double conv = 1.0 / 8388608.0;
             for (int i = 0; i < numElems; i ++)
             {
-                int value = *((int*)temp2);
+                int value = *((const int*)temp2);
                 value = _swap32(value) & 0x00ffffff;             // take 24 bits
                 value |= (value & 0x00800000) ? 0xff000000 : 0;  // extend minus sign bits
                 buffer[i] = (float)(value * conv);
@@ -431,9 +491,20 @@ int WavInFile::read(float *buffer, int maxElems)
 
         case 4:
         {
-            int *temp2 = (int *)temp;
-            double conv = 1.0 / 2147483648.0;
+            const int *temp2 = (const int *)temp;
             assert(sizeof(int) == 4);
+            if (formatTag == WAV_FORMAT_IEEE_FLOAT)
+            {
+                // samples are floats already, just swap byte order if necessary
+                for (int i = 0; i < numElems; i ++)
+                {
+                    int value = temp2[i];
+                    _swap32(value);
+                    memcpy(&buffer[i], &value, sizeof(float));
+                }
+                break;
+            }
+            double conv = 1.0 / 2147483648.0;
             for (int i = 0; i < numElems; i ++)
             {
                 int value = temp2[i];
@@ -442,6 +513,48 @@ int WavInFile::read(float *buffer, int maxElems)
             break;
         }
     }
+}
+
+
+/// Read data in float format. Notice that when reading in float format 
+/// 8/16/24/32 bit sample formats are supported
+int WavInFile::read(float *buffer, int maxElems)
+{
+    unsigned int afterDataRead;
+    int numBytes;
+    int numElems;
+    int bytesPerSample;
+
+    assert(buffer);
+
+    bytesPerSample = header.format.bits_per_sample / 8;
+    if ((bytesPerSample < 1) || (bytesPerSample > 4))
+    {
+        stringstream ss;
+        ss << "\nOnly 8/16/24/32 bit sample WAV files supported. Can't open WAV file with ";
+        ss << (int)header.format.bits_per_sample;
+        ss << " bit sample format. ";
+        ST_THROW_RT_ERROR(ss.str().c_str());
+    }
+
+    numBytes = maxElems * bytesPerSample;
+    afterDataRead = dataRead + numBytes;
+    if (afterDataRead > header.data.data_len) 
+    {
+        // Don't read more samples than are marked available in header
+        numBytes = (int)header.data.data_len - (int)dataRead;
+        assert(numBytes >= 0);
+    }
+
+    // read raw data into temporary buffer
+    char *temp = (char*)getConvBuffer(numBytes);
+    numBytes = (int)fread(temp, 1, numBytes, fptr);
+    dataRead += numBytes;
+
+    numElems = numBytes / bytesPerSample;
+
+    // swap byte ordert & convert to float, depending on sample format
+    convertToFloat(temp, buffer, numElems);
 
     return numElems;
 }
@@ -494,129 +607,221 @@ int WavInFile::readRIFFBlock()
 }
 
 
-int WavInFile::readHeaderBlock()
+// sort markers by position, plain cue points before loops at same position
+static bool markerLess(const WavMarker &a, const WavMarker &b)
 {
-    char label[5];
-    string sLabel;
+    if (a.frame != b.frame) return a.frame < b.frame;
+    return a.length < b.length;
+}
 
-    // lead label string
-    if (fread(label, 1, 4, fptr) !=4) return -1;
-    label[4] = 0;
 
-    if (isAlphaStr(label) == 0) return -1;    // not a valid label
+void WavInFile::readMarkers()
+{
+    uint count, i;
 
-    // Decode blocks according to their label
-    if (strcmp(label, fmtStr) == 0)
+    markers.clear();
+
+    // 'cue ' block: count followed by 24 byte cue point records
+    if ((chunks.cue.offset > 0) && (chunks.cue.len >= 4))
     {
-        int nLen, nDump;
+        fseek(fptr, chunks.cue.offset, SEEK_SET);
+        if (fread(&count, sizeof(uint), 1, fptr) == 1)
+        {
+            _swap32((int &)count);
+            if (count > (chunks.cue.len - 4) / 24) count = (chunks.cue.len - 4) / 24;
+            for (i = 0; i < count; i ++)
+            {
+                uint rec[6];    // id, position, data chunk id, chunk start, block start, sample offset
+                WavMarker m;
+
+                if (fread(rec, sizeof(rec), 1, fptr) != 1) break;
+                _swap32((int &)rec[0]);
+                _swap32((int &)rec[5]);
+                m.id = rec[0];
+                m.frame = rec[5];
+                m.length = 0;
+                markers.push_back(m);
+            }
+        }
+    }
 
-        // 'fmt ' block 
-        memcpy(header.format.fmt, fmtStr, 4);
+    // 'smpl' block: 36 byte header with loop count followed by 24 byte loop records
+    if ((chunks.smpl.offset > 0) && (chunks.smpl.len >= 36))
+    {
+        uint hdr[9];
 
-        // read length of the format field
-        if (fread(&nLen, sizeof(int), 1, fptr) != 1) return -1;
-        // swap byte order if necessary
-        _swap32(nLen);
+        fseek(fptr, chunks.smpl.offset, SEEK_SET);
+        if (fread(hdr, sizeof(hdr), 1, fptr) == 1)
+        {
+            count = hdr[7];
+            _swap32((int &)count);
+            if (count > (chunks.smpl.len - 36) / 24) count = (chunks.smpl.len - 36) / 24;
+            for (i = 0; i < count; i ++)
+            {
+                uint rec[6];    // cue point id, type, start, end, fraction, play count
+                WavMarker m;
+
+                if (fread(rec, sizeof(rec), 1, fptr) != 1) break;
+                _swap32((int &)rec[0]);
+                _swap32((int &)rec[2]);
+                _swap32((int &)rec[3]);
+                if (rec[3] < rec[2]) continue;
+                m.id = rec[0];
+                m.frame = rec[2];
+                m.length = rec[3] - rec[2] + 1;    // loop end is inclusive
+                markers.push_back(m);
+            }
+        }
+    }
 
-        // calculate how much length differs from expected 
-        nDump = nLen - ((int)sizeof(header.format) - 8);
+    // keep one marker per position, loops win over plain cue points
+    std::sort(markers.begin(), markers.end(), markerLess);
+    for (i = 1; i < markers.size(); )
+    {
+        if (markers[i].frame == markers[i - 1].frame)
+        {
+            markers.erase(markers.begin() + i - 1);
+        }
+        else
+        {
+            i ++;
+        }
+    }
+}
 
-        // verify that header length isn't smaller than expected structure
-        if ((nLen < 0) || (nDump < 0)) return -1;
 
-        header.format.format_len = nLen;
+int WavInFile::readFormatBlock(uint len)
+{
+    unsigned char buf[40];
+    uint nRead;
 
-        // if format_len is larger than expected, read only as much data as we've space for
-        if (nDump > 0)
-        {
-            nLen = sizeof(header.format) - 8;
-        }
+    // verify that header length isn't smaller than expected structure
+    if (len < sizeof(header.format) - 8) return -1;
 
-        // read data
-        if (fread(&(header.format.fixed), nLen, 1, fptr) != 1) return -1;
+    // read the basic & extensible parts at once, the rest is skipped by caller
+    nRead = (len < sizeof(buf)) ? len : (uint)sizeof(buf);
+    if (fread(buf, nRead, 1, fptr) != 1) return -1;
 
-        // swap byte order if necessary
-        _swap16((short &)header.format.fixed);            // short int fixed;
-        _swap16((short &)header.format.channel_number);   // short int channel_number;
-        _swap32((int &)header.format.sample_rate);        // int sample_rate;
-        _swap32((int &)header.format.byte_rate);          // int byte_rate;
-        _swap16((short &)header.format.byte_per_sample);  // short int byte_per_sample;
-        _swap16((short &)header.format.bits_per_sample);  // short int bits_per_sample;
-
-        // if format_len is larger than expected, skip the extra data
-        if (nDump > 0)
+    memcpy(header.format.fmt, fmtStr, 4);
+    header.format.format_len = len;
+    memcpy(&(header.format.fixed), buf, sizeof(header.format) - 8);
+
+    // swap byte order if necessary
+    _swap16((short &)header.format.fixed);            // short int fixed;
+    _swap16((short &)header.format.channel_number);   // short int channel_number;
+    _swap32((int &)header.format.sample_rate);        // int sample_rate;
+    _swap32((int &)header.format.byte_rate);          // int byte_rate;
+    _swap16((short &)header.format.byte_per_sample);  // short int byte_per_sample;
+    _swap16((short &)header.format.bits_per_sample);  // short int bits_per_sample;
+
+    formatTag = header.format.fixed;
+    if (formatTag == WAV_FORMAT_EXTENSIBLE)
+    {
+        // cbSize, valid bits, channel mask & sub-format GUID follow the basic part
+        if (nRead < sizeof(buf)) return -1;
+        memcpy(&(formatExt.valid_bits), buf + 18, 2);
+        memcpy(&(formatExt.channel_mask), buf + 20, 4);
+        memcpy(formatExt.sub_format, buf + 24, 16);
+        _swap16((short &)formatExt.valid_bits);
+        _swap32((int &)formatExt.channel_mask);
+
+        // resolve sub-format GUID to the plain format tag
+        if (memcmp(formatExt.sub_format + 2, subFormatGuidTail, sizeof(subFormatGuidTail)) != 0)
         {
-            fseek(fptr, nDump, SEEK_CUR);
+            formatTag = 0;
+        }
+        else
+        {
+            formatTag = formatExt.sub_format[0] | (formatExt.sub_format[1] << 8);
         }
-
-        return 0;
     }
-    else if (strcmp(label, factStr) == 0)
-    {
-        int nLen, nDump;
 
-        // 'fact' block 
-        memcpy(header.fact.fact_field, factStr, 4);
+    return 0;
+}
 
-        // read length of the fact field
-        if (fread(&nLen, sizeof(int), 1, fptr) != 1) return -1;
-        // swap byte order if necessary
-        _swap32(nLen);
 
-        // calculate how much length differs from expected
-        nDump = nLen - ((int)sizeof(header.fact) - 8);
+int WavInFile::readHeaderBlock()
+{
+    char label[5];
+    uint len;
+    long offset;
+    WavChunk *chunk;
+
+    // read label & length of the block with a single read
+    struct 
+    {
+        char id[4];
+        uint len;
+    } block;
 
-        // verify that fact length isn't smaller than expected structure
-        if ((nLen < 0) || (nDump < 0)) return -1;
+    if (fread(&block, sizeof(block), 1, fptr) != 1) 
+    {
+        // end of file is fine once the sample data has been located
+        return (chunks.data.offset > 0) ? 1 : -1;
+    }
+    memcpy(label, block.id, 4);
+    label[4] = 0;
 
-        header.fact.fact_len = nLen;
+    // tolerate trailing garbage after the sample data
+    if (isAlphaStr(label) == 0) return (chunks.data.offset > 0) ? 1 : -1;
 
-        // if format_len is larger than expected, read only as much data as we've space for
-        if (nDump > 0)
-        {
-            nLen = sizeof(header.fact) - 8;
-        }
+    len = block.len;
+    _swap32((int &)len);
+    offset = ftell(fptr);
+    chunk = NULL;
 
-        // read data
-        if (fread(&(header.fact.fact_sample_len), nLen, 1, fptr) != 1) return -1;
+    // Decode blocks according to their label
+    if (strcmp(label, fmtStr) == 0)
+    {
+        // 'fmt ' block 
+        if (readFormatBlock(len) != 0) return -1;
+        chunk = &chunks.fmt;
+    }
+    else if (strcmp(label, factStr) == 0)
+    {
+        // 'fact' block 
+        if (len < sizeof(header.fact.fact_sample_len)) return -1;
+        memcpy(header.fact.fact_field, factStr, 4);
+        header.fact.fact_len = len;
+        if (fread(&(header.fact.fact_sample_len), sizeof(uint), 1, fptr) != 1) return -1;
 
         // swap byte order if necessary
         _swap32((int &)header.fact.fact_sample_len);    // int sample_length;
-
-        // if fact_len is larger than expected, skip the extra data
-        if (nDump > 0)
-        {
-            fseek(fptr, nDump, SEEK_CUR);
-        }
-
-        return 0;
+        chunk = &chunks.fact;
     }
     else if (strcmp(label, dataStr) == 0)
     {
         // 'data' block
         memcpy(header.data.data_field, dataStr, 4);
-        if (fread(&(header.data.data_len), sizeof(uint), 1, fptr) != 1) return -1;
-
-        // swap byte order if necessary
-        _swap32((int &)header.data.data_len);
-
-        return 1;
+        header.data.data_len = len;
+        chunk = &chunks.data;
+    }
+    else if (strcmp(label, cueStr) == 0)
+    {
+        chunk = &chunks.cue;
     }
-    else
+    else if (strcmp(label, smplStr) == 0)
     {
-        uint len, i;
-        uint temp;
-        // unknown block
+        chunk = &chunks.smpl;
+    }
+    else if (strcmp(label, listStr) == 0)
+    {
+        chunk = &chunks.list;
+    }
 
-        // read length
-        if (fread(&len, sizeof(len), 1, fptr) != 1) return -1;
-        // scan through the block
-        for (i = 0; i < len; i ++)
-        {
-            if (fread(&temp, 1, 1, fptr) != 1) return -1;
-            if (feof(fptr)) return -1;   // unexpected eof
-        }
+    if (chunk != NULL)
+    {
+        chunk->offset = offset;
+        chunk->len = len;
+    }
+
+    // jump to the next block, blocks are padded to even length
+    if ((offset < 0) || (fseek(fptr, offset + (long)len + (len & 1), SEEK_SET) != 0))
+    {
+        // non-seekable stream; the sample data has to be the last block then
+        return (chunk == &chunks.data) ? 1 : -1;
     }
+
     return 0;
 }
 
@@ -626,10 +831,13 @@ int WavInFile::readWavHeaders()
     int res;
 
     memset(&header, 0, sizeof(header));
+    memset(&formatExt, 0, sizeof(formatExt));
+    memset(&chunks, 0, sizeof(chunks));
+    formatTag = 0;
 
     res = readRIFFBlock();
     if (res) return 1;
-    // read header blocks until data block is found
+    // index all blocks of the file, whichever order they are in
     do
     {
         // read header blocks
@@ -647,6 +855,30 @@ uint WavInFile::getNumChannels() const
 }
 
 
+uint WavInFile::getFormatTag() const
+{
+    return formatTag;
+}
+
+
+uint WavInFile::getChannelMask() const
+{
+    return formatExt.channel_mask;
+}
+
+
+const WavChunkIndex &WavInFile::getChunkIndex() const
+{
+    return chunks;
+}
+
+
+const std::vector<WavMarker> &WavInFile::getMarkers() const
+{
+    return markers;
+}
+
+
 uint WavInFile::getNumBits() const
 {
     return header.format.bits_per_sample;
@@ -674,7 +906,7 @@ uint WavInFile::getDataSizeInBytes() const
 uint WavInFile::getNumSamples() const
 {
     if (header.format.byte_per_sample == 0) return 0;
-    if (header.format.fixed > 1) return header.fact.fact_sample_len;
+    // only PCM & float formats are accepted, so sample count follows from data length
     return header.data.data_len / (unsigned short)header.format.byte_per_sample;
 }
 
@@ -783,10 +1015,69 @@ void WavOutFile::fillInHeader(uint sampleRate, uint bits, uint channels)
 }
 
 
+void WavOutFile::addCuePoint(uint frame)
+{
+    cuePoints.push_back(frame);
+}
+
+
+int WavOutFile::writeCueBlock()
+{
+    int numBytes;
+    uint i;
+
+    if (cuePoints.size() == 0) return 0;
+
+    fseek(fptr, 0, SEEK_END);
+    numBytes = 0;
+
+    // blocks start at even offsets
+    if (bytesWritten & 1)
+    {
+        if (fputc(0, fptr) == EOF) ST_THROW_RT_ERROR("Error while writing to a wav file.");
+        numBytes ++;
+    }
+
+    uint hdr[3];
+    memcpy(&hdr[0], cueStr, 4);
+    hdr[1] = 4 + 24 * (uint)cuePoints.size();
+    hdr[2] = (uint)cuePoints.size();
+    _swap32((int &)hdr[1]);
+    _swap32((int &)hdr[2]);
+    if (fwrite(hdr, sizeof(hdr), 1, fptr) != 1) ST_THROW_RT_ERROR("Error while writing to a wav file.");
+    numBytes += sizeof(hdr);
+
+    for (i = 0; i < cuePoints.size(); i ++)
+    {
+        // id, position, data chunk id, chunk start, block start, sample offset
+        uint rec[6];
+
+        rec[0] = i + 1;
+        rec[1] = cuePoints[i];
+        memcpy(&rec[2], dataStr, 4);
+        rec[3] = 0;
+        rec[4] = 0;
+        rec[5] = cuePoints[i];
+        _swap32((int &)rec[0]);
+        _swap32((int &)rec[1]);
+        _swap32((int &)rec[5]);
+        if (fwrite(rec, sizeof(rec), 1, fptr) != 1) ST_THROW_RT_ERROR("Error while writing to a wav file.");
+        numBytes += sizeof(rec);
+    }
+
+    return numBytes;
+}
+
+
 void WavOutFile::finishHeader()
 {
+    int trailBytes;
+
+    // append the cue points after sample data
+    trailBytes = writeCueBlock();
+
     // supplement the file length into the header structure
-    header.riff.package_len = bytesWritten + sizeof(WavHeader) - sizeof(WavRiff) + 4;
+    header.riff.package_len = bytesWritten + trailBytes + sizeof(WavHeader) - sizeof(WavRiff) + 4;
     header.data.data_len = bytesWritten;
     header.fact.fact_sample_len = bytesWritten / header.format.byte_per_sample; 
     
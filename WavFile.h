@@ -41,6 +41,8 @@
 #define WAVFILE_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <vector>
 #include <alsa/asoundlib.h>
 
 #ifndef uint
@@ -94,6 +96,37 @@ typedef struct
     WavData   data;
 } WavHeader;
 
+/// Format tags understood by the reader
+#define WAV_FORMAT_PCM         0x0001
+#define WAV_FORMAT_IEEE_FLOAT  0x0003
+#define WAV_FORMAT_EXTENSIBLE  0xFFFE
+
+/// WAVE_FORMAT_EXTENSIBLE extension of the 'fmt ' block
+typedef struct 
+{
+    unsigned short valid_bits;
+    unsigned int   channel_mask;
+    unsigned char  sub_format[16];
+} WavFormatExt;
+
+/// Location of a single RIFF chunk payload within the file
+typedef struct 
+{
+    long offset;        ///< File offset of the payload, i.e. just after id & length. 0 if absent.
+    uint len;           ///< Payload length in bytes
+} WavChunk;
+
+/// Index of the chunks of interest, gathered in a single pass over the file
+typedef struct 
+{
+    WavChunk fmt;
+    WavChunk fact;
+    WavChunk data;
+    WavChunk cue;
+    WavChunk smpl;
+    WavChunk list;
+} WavChunkIndex;
+
 
 /// Base class for processing WAV audio files.
 class WavFileBase
@@ -112,6 +145,15 @@ protected:
 };
 
 
+/// Marker imported from a 'cue ' point or a 'smpl' loop
+typedef struct 
+{
+    uint id;            ///< Cue point or loop identifier
+    uint frame;         ///< Marker position in sample frames
+    uint length;        ///< Loop length in sample frames, 0 for plain cue points
+} WavMarker;
+
+
 /// Class for reading WAV audio files.
 class WavInFile : protected WavFileBase
 {
@@ -128,9 +170,30 @@ private:
     /// WAV header information
     WavHeader header;
 
+    /// Extensible format information, zeroed for plain PCM/float files
+    WavFormatExt formatExt;
+
+    /// Effective format tag, i.e. the extensible sub-format resolved to PCM or float
+    uint formatTag;
+
+    /// Chunk offsets, parsed once when the file is opened
+    WavChunkIndex chunks;
+
+    /// Cue points & sample loops sorted by position
+    std::vector<WavMarker> markers;
+
     /// Init the WAV file stream
     void init();
 
+    /// Position the stream at given byte offset within the data chunk
+    void seekData(long byteOffset);
+
+    /// Size of the stack block used by 'readFrames'
+    enum { READ_BLOCK_SIZE = 16384 };
+
+    /// Converts 'numElems' raw samples of the file's sample format to float
+    void convertToFloat(const char *temp, float *buffer, int numElems) const;
+
     /// Read WAV file headers.
     /// \return zero if all ok, nonzero if file format is invalid.
     int readWavHeaders();
@@ -139,10 +202,18 @@ private:
     /// \return zero if all ok, nonzero if file format is invalid.
     int checkCharTags() const;
 
-    /// Reads a single WAV file header block.
-    /// \return zero if all ok, nonzero if file format is invalid.
+    /// Reads a single WAV file header block and records its offset into the chunk index.
+    /// \return zero to continue, 1 when the whole file has been indexed, negative if
+    /// file format is invalid.
     int readHeaderBlock();
 
+    /// Parses the indexed 'cue ' and 'smpl' blocks into 'markers'
+    void readMarkers();
+
+    /// Decodes the 'fmt ' block payload including the extensible part
+    /// \return zero if all ok, nonzero if file format is invalid.
+    int readFormatBlock(uint len);
+
     /// Reads WAV file 'riff' block
     int readRIFFBlock();
 
@@ -156,9 +227,26 @@ public:
     /// Destructor: Closes the file.
     ~WavInFile();
 
-    /// Rewind to beginning of the file
+    /// Rewind to beginning of the sample data. Uses the cached data chunk offset,
+    /// the headers aren't parsed again.
     void rewind();
 
+    /// Position the sequential 'read' stream at given sample frame. Seeking is done
+    /// with the cached data chunk offset, i.e. constant time. Positions past the end
+    /// of data are clamped to end of data.
+    void seekFrame(uint64_t frame);
+
+    /// Reads 'count' sample frames starting at frame 'offset' into 'buffer' in 
+    /// floating point format, like 'read(float*, int)' does. The read is positioned
+    /// (pread) and doesn't move nor use the sequential stream position, so several
+    /// threads can read different regions of the same file concurrently.
+    ///
+    /// \return Number of frames read, less than 'count' at end of data.
+    int readFrames(uint64_t offset,   ///< First frame to read
+                   int count,         ///< Number of frames to read
+                   float *buffer      ///< Destination, room for 'count * channels' elements
+                   ) const;
+
     /// Get sample rate.
     uint getSampleRate() const;
 
@@ -178,6 +266,18 @@ public:
     /// Get number of audio channels in the file (1=mono, 2=stereo)
     uint getNumChannels() const;
 
+    /// Get effective sample format, WAV_FORMAT_PCM or WAV_FORMAT_IEEE_FLOAT
+    uint getFormatTag() const;
+
+    /// Get speaker position mask of an extensible file, zero if not given
+    uint getChannelMask() const;
+
+    /// Get offsets of the chunks found in the file
+    const WavChunkIndex &getChunkIndex() const;
+
+    /// Get cue points & loop starts of the file, sorted by frame position
+    const std::vector<WavMarker> &getMarkers() const;
+
     /// Get the audio file length in milliseconds
     uint getLengthMS() const;
 
@@ -235,6 +335,13 @@ private:
     /// Counter of how many bytes have been written to the file so far.
     int bytesWritten;
 
+    /// Cue point positions written after the sample data
+    std::vector<uint> cuePoints;
+
+    /// Writes the 'cue ' block to end of file.
+    /// \return number of bytes written
+    int writeCueBlock();
+
     /// Fills in WAV file header information.
     void fillInHeader(const uint sampleRate, const uint bits, const uint channels);
 
@@ -259,6 +366,10 @@ public:
     /// Destructor: Finalizes & closes the WAV file.
     ~WavOutFile();
 
+    /// Adds a cue point at given sample frame. Cue points are stored in a 'cue '
+    /// block after the sample data when the file is finalized.
+    void addCuePoint(uint frame);
+
     /// Write data to WAV file. This function works only with 8bit samples. 
     /// Throws a 'runtime_error' exception if writing to file fails.
     void write(const unsigned char *buffer, ///< Pointer to sample data buffer.
@@ -5,11 +5,37 @@
 #include <time.h>
 #include <vector>
 #include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <math.h>
+#include <new>
 #include "RunParameters.h"
 #include "WavFile.h"
+#include "Resampler.h"
+#include "SampleData.h"
+#include "Voice.h"
+#include "RtMemory.h"
+#include "Sequencer.h"
+#include "MidiClock.h"
+#include "ControllerMap.h"
+#include "PreviewPack.h"
+#include "FxChain.h"
+#include "Varispeed.h"
+#include "StreamResampler.h"
+#include "RenderPool.h"
 #include <soundtouch/SoundTouch.h>
 #include <soundtouch/BPMDetect.h>
 #include <alsa/asoundlib.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 using namespace soundtouch;
 using namespace std;
@@ -17,7 +43,9 @@ using namespace std;
 // Processing chunk size (size chosen to be divisible by 2, 4, 6, 8, 10, 12, 14, 16 channels ...)
 #define BUFF_SIZE  1024*2
 #define PCM_DEVICE "default"
-#define RATE 44100
+// pcm devices & stereo output buses across them
+#define MAX_OUTPUTS 4
+#define MAX_BUSES 8
 #define TEMPO_CTL 0x12 
 #define PITCH_CTL 0x13
 //#define RATE_CTL 0x56
@@ -29,41 +57,329 @@ using namespace std;
 #define CHANNELS 2
 #define SOUNDTOUCH_INTEGER_SAMPLES 1
 #define SET_STREAM_TO_BIN_MODE(f) {}
-#define MAX_PCM_HANDLES 5
+#define SAVE_CTL 0x52
+#define RELEASE_CTL 0x48
+#define ATTACK_CTL 0x49
+#define DECAY_CTL 0x4b
+#define SUSTAIN_CTL 0x46
+#define POLY_CTL 0x53
+#define STEAL_CTL 0x54
+#define SEQ_RUN_CTL 0x55
+#define SEQ_REC_CTL 0x56
+#define SEQ_BPM_CTL 0x57
+#define SEQ_SWING_CTL 0x58
+#define SEQ_LENGTH_CTL 0x59
+#define SEQ_CLEAR_CTL 0x5a
+#define CLOCK_CTL 0x5c
+#define MATCH_CTL 0x5d
+#define BANK_CTL 0x5e
+#define BANK_NEXT_CTL 0x66
+#define BANK_PREV_CTL 0x67
+#define ORDER_CTL 0x68
+#define BPM_MIN_CTL 0x69
+#define BPM_MAX_CTL 0x6a
+#define SEEK_CTL 0x6b
+#define FILTER_CTL 0x6c
+#define CUTOFF_CTL 0x4a
+#define RESONANCE_CTL 0x47
+#define DRIVE_CTL 0x6d
+#define GAIN_CTL 0x07
+#define PAN_CTL 0x0a
+#define PLAY_MODE_CTL 0x6e
+#define INTERP_CTL 0x6f
+#define CHROMATIC_CTL 0x70
+#define METRICS_CTL 0x71
+#define OUTPUT_CTL 0x72
 #define MAX_SAMPLES 16 
 #define MAX_SLICES 88 
-
-
+// frames loaded per file for browse previews
+#define PREVIEW_FRAMES (100*BUFF_SIZE/CHANNELS)
+// preview pack in the sample directory
+#define PACK_FILE ".chopogy-previews"
+// keys of a browse bank, starting at the low key & repeating every octave pair
+#define BANK_KEYS 24
+#define BANK_LOW_KEY 36
+// directory changes watched by the library thread
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | \
+    IN_CREATE | IN_ONLYDIR)
+// frames a slice start/end moves per step of the slice controllers
+#define SLICE_NUDGE_FRAMES (BUFF_SIZE/CHANNELS)
+// voices mixed by the audio thread & its workers, per rendering thread
+#define MAX_VOICES 256
+#define VOICES_PER_THREAD 32
+// fewest frames of the period mixed down by a job of the pool, a multiple
+// of 8 keeps the slices of a bus on their own cache lines
+#define MIX_MIN_SLICE_FRAMES 16
+// share of the latest period in the mixing times shown by the metrics
+#define METRICS_SMOOTHING 0.01f
+// frames mixed & written per pcm period
+#define PERIOD_FRAMES 128
+#define NUM_PERIODS 4
+// size of the midi to audio thread event queue, power of 2
+#define MAX_EVENTS 256
+// size of the audio to midi thread clock queue, power of 2
+#define MAX_CLOCK_MSGS 64
+// size of the head to midi thread queue of tables with heads, power of 2
+#define MAX_HEAD_JOBS 64
+// fade out of voices cut off by their choke group
+#define CHOKE_SECONDS 0.005f
+// SCHED_FIFO priority of the audio thread in realtime mode
+#define AUDIO_PRIORITY 70
+// audio thread stack faulted in before mixing
+#define AUDIO_STACK_PREFAULT (64*1024)
+// sequencer triggers handled per period
+#define MAX_TRIGGERS (MAX_SAMPLES * SEQ_LANES)
+// steps of new patterns
+#define SEQ_DEFAULT_STEPS 16
+// midi clock ticks per sequencer step
+#define CLOCKS_PER_STEP (CLOCK_PPQN / SEQ_STEPS_PER_BEAT)
+// jitter filter of incoming clock in Hz
+#define CLOCK_BANDWIDTH 0.5
+// smoothed modulation closer than this to its target jumps to it
+#define SMOOTH_EPSILON 0.01f
+// smallest session tempo change re-applied to playing voices
+#define MATCH_MIN_BPM_CHANGE 0.05f
+// insert filter cutoff in Hz & resonance as Q over the controller range,
+// both exponential. Resonance defaults to a Q of 1/sqrt(2)
+#define CUTOFF_MIN 20.0f
+#define CUTOFF_RANGE 1000.0f
+#define Q_MIN 0.5f
+#define Q_RANGE 24.0f
+#define RESONANCE_DEFAULT 0.109f
+// gain this close to unity snaps to it, so the chain of the channel can be bypassed
+#define GAIN_DETENT 0.02f
+// SoundTouch output made ahead of time for the start of every slice. Stretched
+// voices play it while their processor catches up with a bounded feed per period
+#define PRIME_HEAD_FRAMES 2048
+// key playing the slice of a chromatic channel untransposed
+#define CHROMATIC_ROOT 60
+// tempo change per step of phase error when following clock, & its limit
+#define CLOCK_PHASE_GAIN 0.05
+#define CLOCK_MAX_CORRECTION 0.02
+// pitch bend range in semitones
+#define BEND_SEMITONES 2.0f
+// default NRPNs of fine slice & pitch control
+#define SLICE_START_NRPN 0
+#define SLICE_END_NRPN 1
+#define PITCH_NRPN 2
+
+
+// slice boundaries & their offsets are in sample frames
 struct slice {
 	long unsigned int start;
-	long unsigned int start_offset;
+	long int start_offset;
 	long unsigned int end;
-	long unsigned int end_offset;
+	long int end_offset;
 };
 
 struct sample {
-  unsigned int channels;
   unsigned int rate;
   int bits;
 	// lowest key in range
 	int low_key;
-	vector<SAMPLETYPE*> *buffers;
+	// 1 or CHANNELS channels at rate of the pcm, shared with voices
+	sample_data *audio;
+	// whole file loaded, not just the preview
+	bool loaded;
   WavInFile *file;
+  // file of a channel whose snippet was freed, closed when the channel
+  // is reloaded
+  bool owns_file;
+  string path;
 	slice slices[MAX_SLICES];
 	slice *selectedSlice;
   int bpm;
+  // length of the whole file in seconds
+  float duration;
+  // size & modification time of the file the snippet was made from
+  off_t file_size;
+  time_t file_mtime;
+};
+
+// Snippets of the library as browsed by the midi thread. Published whole by
+// the library thread & never changed after. 'removed' are the snippets
+// dropped since the list the midi thread took last, it frees them
+struct snippet_list {
+  vector<sample *> samples;
+  vector<sample *> removed;
 };
 
+// Slice table of a channel as heard by the audio thread. Built by the control
+// thread whenever slices are edited and swapped in whole, never modified
+// after it is published, so note on is a single lookup by key. Heads missing
+// from a table come with a copy swapped in once they are rendered
+struct slice_map {
+  // referenced until the table is freed
+  sample_data *audio;
+  // detected tempo of the sample, 0 if unknown
+  float bpm;
+  // slice start before nudging, unset starts follow on from the lower key
+  long int origin[MAX_SLICES];
+  // region of each key, nudges applied
+  long int start[MAX_SLICES];
+  long int end[MAX_SLICES];
+  // SoundTouch output of the start of each region, NULL for empty ones &
+  // until rendered, & the stretch settings it was made at
+  sample_data *heads[MAX_SLICES];
+  float head_tempo;
+  float head_pitch;
+  float head_rate;
+};
+
+// how the voices of a channel play, set by controller value: stretched by
+// SoundTouch, as recorded, or sped up & down like a tape machine
 enum fx_mode{ST_STRETCH, ST_PASSTHROUGH= 0x19, ST_MACHINE=0x33};
+
+// which voice of a channel gives way when it runs out of polyphony
+enum steal_policy{STEAL_OLDEST, STEAL_QUIETEST, STEAL_SAME_NOTE};
+
+enum clock_mode{CLOCK_INTERNAL, CLOCK_FOLLOW, CLOCK_SEND};
+
+// order of the browse catalogue, ties stay in name order
+enum catalogue_order{ORDER_NAME, ORDER_BPM, ORDER_DURATION};
+
+// what controllers do, bound by the controller map. Names are used in map files
+enum ctl_action{ACT_NONE, ACT_MODE, ACT_SLICE_START, ACT_SLICE_END, ACT_SAVE,
+  ACT_TEMPO, ACT_PITCH, ACT_RATE, ACT_BEND, ACT_ATTACK, ACT_DECAY, ACT_SUSTAIN,
+  ACT_RELEASE, ACT_POLY, ACT_STEAL, ACT_SEQ_RUN, ACT_SEQ_REC, ACT_SEQ_BPM,
+  ACT_SEQ_SWING, ACT_SEQ_LENGTH, ACT_SEQ_CLEAR, ACT_CLOCK, ACT_MATCH, ACT_BANK,
+  ACT_BANK_NEXT, ACT_BANK_PREV, ACT_ORDER, ACT_BPM_MIN, ACT_BPM_MAX, ACT_SEEK,
+  ACT_FILTER, ACT_CUTOFF, ACT_RESONANCE, ACT_DRIVE, ACT_GAIN, ACT_PAN,
+  ACT_PLAY_MODE, ACT_INTERP, ACT_CHROMATIC, ACT_METRICS,
+  ACT_OUTPUT, NUM_ACTIONS};
+static const char * const ctl_names[NUM_ACTIONS] = {NULL, "mode", "slice_start",
+  "slice_end", "save", "tempo", "pitch", "rate", "bend", "attack", "decay",
+  "sustain", "release", "poly", "steal", "seq_run", "seq_rec", "seq_bpm",
+  "seq_swing", "seq_length", "seq_clear", "clock", "match", "bank", "bank_next",
+  "bank_prev", "order", "bpm_min", "bpm_max", "seek", "filter", "cutoff",
+  "resonance", "drive", "gain", "pan", "play_mode", "interp",
+  "chromatic", "metrics", "output"};
+
+// Controller value smoothed by the audio thread once per period. The midi
+// thread only overwrites the target, so a burst of controller events costs
+// the audio thread no more than a single one
+struct smoothed {
+  atomic<float> target;
+  float value;
+};
+
+// Insert chain settings of a channel, set by the midi thread & smoothed
+// into the chain by the audio thread
 struct fxctl {
-  fx_mode mode;
+  // fx_mode & varispeed interp_type taken by voices at note on
+  atomic_int mode;
+  atomic_int interp;
   int pitch;
   int rate;
+  atomic_int filter;
+  // cutoff & resonance as controller positions 0..1, gain linear
+  smoothed cutoff;
+  smoothed resonance;
+  smoothed drive;
+  smoothed gain;
+  smoothed pan;
+  // filter type the chain is set up for & whether it ran last period
+  int applied_filter;
+  bool active;
+};
+
+// envelope of a channel, set by the midi thread & taken by voices at note on
+struct env_ctl {
+  atomic<float> attack;
+  atomic<float> decay;
+  atomic<float> sustain;
+  atomic<float> release;
+};
+
+// EV_NOTE_ON plays the region of the event, EV_SLICE_ON the slice of the
+// key in the slice table of the channel. EV_SLICE_END is sent back by the
+// audio thread with the frame heard at note off
+enum voice_event_type{EV_NOTE_ON, EV_SLICE_ON, EV_NOTE_OFF, EV_SLICE_END};
+struct voice_event {
+  voice_event_type type;
+  int channel;
+  int note;
+  int velocity;
+  // key of the slice table played by EV_SLICE_ON & semitones it's transposed
+  int slice;
+  float transpose;
+  // region to play on note on, the event holds a reference to the audio
+  sample_data *audio;
+  long int start;
+  long int end;
+  float bpm;
+  // slice plays to end of sample, as in edit mode
+  bool to_end;
+  // note off reports the slice end heard so far
+  bool report_end;
+  // cut off all other voices of the channel
+  bool exclusive;
+  // frames into the period the voice starts at
+  int offset;
+  // step a live note was recorded to ahead of the sequencer, -1 if none
+  int seq_step;
+};
+
+// single producer (midi thread), single consumer (audio thread)
+struct event_queue {
+  voice_event events[MAX_EVENTS];
+  atomic_uint head;
+  atomic_uint tail;
+};
+
+// midi realtime message, due at 'due' seconds of CLOCK_MONOTONIC
+struct clock_msg {
+  snd_seq_event_type_t type;
+  double due;
+};
+
+// single producer (audio thread), single consumer (midi thread)
+struct clock_msg_queue {
+  clock_msg msgs[MAX_CLOCK_MSGS];
+  atomic_uint head;
+  atomic_uint tail;
+};
+
+// copy of the slice table of a channel the head thread renders the missing
+// heads of, for table 'version' of the channel
+struct head_job {
+  int channel;
+  unsigned int version;
+  slice_map *table;
+  // all heads rendered, the table is still the latest
+  bool done;
+};
+
+// single producer (head thread), single consumer (midi thread)
+struct head_queue {
+  head_job *jobs[MAX_HEAD_JOBS];
+  atomic_uint head;
+  atomic_uint tail;
 };
 
-// wrapper for pcm type 
-struct pcm_handle {
-	snd_pcm_t *pcm;
+// pcm device written by the audio thread, its channel pairs are consecutive
+// output buses
+struct output {
+  snd_pcm_t *pcm;
+  string device;
+  int channels;
+  int first_bus;
+  // rate & buffer frames granted by the device
+  unsigned int rate;
+  long int buffer;
+  // interleaved period of its buses, for devices of more than one pair
+  SAMPLETYPE *frames;
+  // conversion from the engine rate, for devices at another rate & devices
+  // on another clock than the first, which also have their drift tracked
+  bool resampling;
+  stream_resampler resampler;
+  SAMPLETYPE *resampled;
+  // devices written without blocking are filled to half their buffer first
+  bool primed;
+  atomic<float> drift_ppm;
+  // periods lost to underruns & periods dropped as the device had no room
+  atomic_uint xruns;
+  atomic_uint dropped;
 };
 
 // enum chp_program{CHP_BROWSE, CHP_EDIT = 0x19, CHP_MPC = 0x33};
@@ -73,345 +389,2603 @@ struct ctx {
   // program
   chp_program prog;
 
-  // pcm_outputs
-  pcm_handle pcm_handles[MAX_PCM_HANDLES];
-
-  // cursor of pcms
-	unsigned int pcm_cursor;
+  // pcm outputs, the first paces the mix & the others are written without
+  // blocking
+  output outputs[MAX_OUTPUTS];
+  int num_outputs;
+  int num_buses;
+  // output bus of each midi channel, set by the midi thread & taken by the
+  // audio thread once per period
+  atomic_int routes[MAX_SAMPLES];
+  int period_routes[MAX_SAMPLES];
+
+  // sample rate the engine runs at, converted to the rate of each pcm
+  unsigned int rate;
 
-  // sample browser
-  vector<sample *> snippets;
+  // frames between mixing and hearing
+  long int latency;
+
+  // sample browser, previews are played from the pack when it could be opened.
+  // the library thread scans & watches the sample directory and hands the
+  // midi thread a new list of snippets whenever files change
+  const snippet_list *snippets;
+  atomic<snippet_list *> pending_snippets;
+  preview_pack pack;
+  bool use_pack;
+
+  // snippets in browse order, rebuilt by the midi thread when the list,
+  // order or filter changes. Keys play a bank of BANK_KEYS of them
+  vector<sample *> catalogue;
+  catalogue_order order;
+  // tempo range shown, 0 for no limit
+  float bpm_min;
+  float bpm_max;
+  int bank;
+
+  // library, owned by the library thread. Snippets are keyed by their path
+  // relative to the sample directory, watches map to directories alike
+  string library_path;
+  map<string, sample *> library;
+  vector<sample *> library_removed;
+  int inotify_fd;
+  unordered_map<int, string> watches;
 
   // active samples 
   sample samples[MAX_SAMPLES];
 
   // current midi chan
   int midi_chan;
+  // channels whose keys transpose the selected slice
+  bool chromatic[MAX_SAMPLES];
 
   // selected sample to edit
 	sample *selectedSample;
 
-  // modulation 
-  SoundTouch soundTouch;
-
-  //fxctl 
-  fxctl fx;
+  // slice tables published to the audio thread, replaced ones are freed
+  // once the audio thread has passed the epoch they were retired in
+  atomic<const slice_map *> slice_maps[MAX_SAMPLES];
+  vector<pair<const slice_map *, unsigned int> > retired_maps;
+  atomic_uint audio_epoch;
+  // heads are rendered by the head thread, the table of a channel is
+  // replaced by its copy with heads if still the latest version then
+  atomic_uint slice_versions[MAX_SAMPLES];
+  atomic<head_job *> head_jobs[MAX_SAMPLES];
+  head_queue finished_heads;
+  // wake the head thread for jobs & the midi thread for finished heads
+  int head_wake_fd;
+  int heads_ready_fd;
+
+  // sample audio dropped by the midi thread, freed once voices are done
+  vector<sample_data *> retired_audio;
+
+  // modulation, applied to the voices by the audio thread
+  smoothed tempo;
+  smoothed pitch;
+  smoothed rate_change;
+  // pitch set by the pitch controller & by pitch bend, summed into 'pitch'
+  float pitch_ctl;
+  float bend;
+  // share of the distance to the target covered per period
+  float smooth_coef;
+  atomic_uint fx_version;
+
+  // voices & output bus mixes, owned by the audio thread & allocated from the arena
+  rt_arena arena;
+  voice *voices;
+  unsigned int voice_age;
+  SAMPLETYPE *mix;
+  // voices rendered in the period, each to its own output, by the audio
+  // thread & the workers of the pool
+  render_pool pool;
+  voice *render_list[MAX_VOICES];
+  SAMPLETYPE *voice_out;
+  // mix or channel bus each voice of the period mixes down to & slices of
+  // the period mixed down side by side, one per thread
+  SAMPLETYPE *render_dest[MAX_VOICES];
+  int mix_slices;
+  // voices of the last period & time spent rendering & mixing them down on
+  // the pool & on the serial rest of the period: events & insert chains.
+  // Times are in ns & smoothed over some periods
+  atomic_int render_voices;
+  atomic<float> render_ns;
+  atomic<float> serial_ns;
+  event_queue events;
+  // slice ends heard, audio to midi thread
+  event_queue reports;
+
+  // voice allocation tables, owned by the audio thread
+  int num_voices;
+  voice *free_voices[MAX_VOICES];
+  int num_free_voices;
+  // latest voice of each channel & note
+  voice *note_voices[MAX_SAMPLES][128];
+  // voices of each channel, oldest first
+  voice *chan_oldest[MAX_SAMPLES];
+  voice *chan_newest[MAX_SAMPLES];
+  int chan_voice_count[MAX_SAMPLES];
+
+  // envelope & choke group of each midi channel, -1 for no choke
+  env_ctl envs[MAX_SAMPLES];
+  int choke_groups[MAX_SAMPLES];
+
+  // voices & steal_policy of each midi channel, set by the midi thread
+  atomic_int polyphony[MAX_SAMPLES];
+  atomic_int steal[MAX_SAMPLES];
+
+  // gain of each note velocity
+  float velocity_gain[128];
+
+  // sequencer patterns, edited by the midi thread & published like slice tables
+  seq_pattern edit_patterns[MAX_SAMPLES];
+  atomic<const seq_pattern *> patterns[MAX_SAMPLES];
+  vector<pair<const seq_pattern *, unsigned int> > retired_patterns;
+  atomic_bool seq_running;
+  // restart from the first step
+  atomic_bool seq_reset;
+  atomic<float> seq_bpm;
+  atomic<float> seq_swing;
+  // bpm follows the loaded sample until set by controller
+  bool seq_bpm_auto;
+  // stretch samples to the sequencer bpm as session tempo
+  atomic_bool tempo_match;
+  bool seq_record;
+  // position in steps at the end of the last period
+  atomic<double> seq_pos;
+
+  // midi clock, incoming tempo is estimated by the midi thread
+  atomic_int clock_mode;
+  clock_pll pll;
+
+  // sequencer playback, owned by the audio thread
+  sequencer seq;
+  bool seq_was_running;
+  seq_trigger *triggers;
+  // clock out, timed by the audio thread & scheduled ahead of time on a
+  // sequencer queue by the midi thread
+  snd_seq_t *seq_out;
+  int clock_port;
+  int clock_queue;
+  unsigned long int clock_ticks;
+  clock_msg_queue clock_msgs;
+  // polled for midi input, so the midi thread can wake for clock out &
+  // finished heads, which are polled last
+  pollfd *midi_fds;
+  int num_midi_fds;
+  // step each channel & note was recorded to live, so it isn't played twice
+  int recorded_step[MAX_SAMPLES][128];
+
+  // insert chain of each channel, chains & channel buses are owned by the
+  // audio thread & allocated from the arena
+  fxctl fx[MAX_SAMPLES];
+  fx_chain *chains;
+  SAMPLETYPE *buses;
+  bool fx_used[MAX_SAMPLES];
+
+  // controller bindings & decoder state, owned by the midi thread
+  controller_map ctl;
+
+  // renders slice heads, owned by the head thread, & its latency at the
+  // settings of the latest heads
+  SoundTouch primer;
+  atomic_int head_latency;
+  // stretched triggers that started from a head or primed in place, counted
+  // by the audio thread, & the input pushed through SoundTouch before a
+  // voice primed in place sounded, last & worst
+  atomic_uint primed_triggers;
+  atomic_uint cold_triggers;
+  atomic_long last_warmup;
+  atomic_long worst_warmup;
 
   // midi 
   snd_seq_t *seq_handle;
 
 };
 
-// thread id running
-atomic_uchar tid[MAX_SAMPLES];
-
 static const char _helloText[] = 
 "\n"
 "   Chopage v%s -  Copyright (c) Dichtomas Monk\n"
 "=========================================================\n";
 
-// Open all files and store frames in buffer
-static int openFiles(WavInFile **inFile, struct ctx *ctx, const RunParameters *params)
+// WAVE_FORMAT_EXTENSIBLE speaker positions
+#define SPEAKER_FRONT_LEFT 0x1
+#define SPEAKER_FRONT_RIGHT 0x2
+#define SPEAKER_FRONT_CENTER 0x4
+#define SPEAKER_LOW_FREQUENCY 0x8
+#define SPEAKER_BACK_LEFT 0x10
+#define SPEAKER_BACK_RIGHT 0x20
+#define SPEAKER_FRONT_LEFT_OF_CENTER 0x40
+#define SPEAKER_FRONT_RIGHT_OF_CENTER 0x80
+#define SPEAKER_BACK_CENTER 0x100
+#define SPEAKER_SIDE_LEFT 0x200
+#define SPEAKER_SIDE_RIGHT 0x400
+
+// speaker layouts assumed when the file doesn't give a channel mask
+static const unsigned int default_channel_masks[] = {
+  0, 0, 0,
+  0x7,    // 3: L R C
+  0x33,   // 4: L R BL BR
+  0x37,   // 5: L R C BL BR
+  0x3f,   // 6: 5.1
+  0x13f,  // 7: 6.1
+  0x63f,  // 8: 7.1
+  0,      // 9: no common layout
+};
+
+// stereo downmix gains of a single speaker position, the ITU-R BS.775
+// coefficients: fronts in full, centre & surrounds 3 dB down
+static void speaker_gains(unsigned int speaker, float *left, float *right)
+{
+  *left = 0;
+  *right = 0;
+  switch (speaker){
+    case SPEAKER_FRONT_LEFT:
+    case SPEAKER_FRONT_LEFT_OF_CENTER:
+      *left = 1.0f;
+      break;
+    case SPEAKER_FRONT_RIGHT:
+    case SPEAKER_FRONT_RIGHT_OF_CENTER:
+      *right = 1.0f;
+      break;
+    case SPEAKER_FRONT_CENTER:
+      *left = *right = 0.7071f;
+      break;
+    case SPEAKER_BACK_CENTER:
+      *left = *right = 0.5f;
+      break;
+    case SPEAKER_BACK_LEFT:
+    case SPEAKER_SIDE_LEFT:
+      *left = 0.7071f;
+      break;
+    case SPEAKER_BACK_RIGHT:
+    case SPEAKER_SIDE_RIGHT:
+      *right = 0.7071f;
+      break;
+    default:
+      // lfe & height channels are dropped
+      break;
+  }
+}
+
+// Mix multichannel sample data down to the stereo layout of the pcm.
+// Mono samples are kept mono, voices spread them over both channels
+// at playback so they aren't duplicated in memory.
+static void normaliseChannels(sample_data *d, unsigned int channel_mask)
+{
+  unsigned int nch = d->channels;
+  if ((nch == 1) || (nch == CHANNELS) || (d->nframes == 0)){
+    return;
+  }
+
+  // gains of each file channel, speakers in mask are in channel order
+  float gains[16][CHANNELS];
+  if (channel_mask == 0){
+    channel_mask = default_channel_masks[nch < 10 ? nch : 0];
+  }
+  unsigned int speaker = 1;
+  for (unsigned int c = 0; c < nch; c++){
+    while ((speaker != 0) && !(channel_mask & speaker)){
+      speaker <<= 1;
+    }
+    if (speaker != 0){
+      speaker_gains(speaker, &gains[c][0], &gains[c][1]);
+      speaker <<= 1;
+    } else {
+      // unknown position, alternate between left & right
+      gains[c][0] = (c % 2 == 0) ? 1.0f : 0;
+      gains[c][1] = (c % 2 == 1) ? 1.0f : 0;
+    }
+  }
+
+  SAMPLETYPE *data = new SAMPLETYPE[d->nframes * CHANNELS];
+  float peak = 0;
+  for (long int i = 0; i < d->nframes; i++){
+    const SAMPLETYPE *in = &d->frames[i * nch];
+    float l = 0, r = 0;
+    for (unsigned int c = 0; c < nch; c++){
+      l += in[c] * gains[c][0];
+      r += in[c] * gains[c][1];
+    }
+    data[i * CHANNELS] = l;
+    data[i * CHANNELS + 1] = r;
+    peak = max(peak, max(fabsf(l), fabsf(r)));
+  }
+
+  // fronts keep the level of a stereo file of the same material, the mix
+  // is only scaled down if it actually clips
+  if (peak > 1.0f){
+    float norm = 1.0f / peak;
+    for (long int i = 0; i < d->nframes * CHANNELS; i++){
+      data[i] *= norm;
+    }
+  }
+  delete[] d->frames;
+  d->frames = data;
+  d->channels = CHANNELS;
+}
+
+// Convert sample data to the pcm rate. Done once at load time, the
+// converted data replaces the original
+static void convertRate(sample_data *d, unsigned int from, unsigned int rate)
+{
+  if ((from == rate) || (d->nframes == 0)){
+    return;
+  }
+
+  Resampler resampler(from, rate);
+  long nframes = resampler.getOutputFrames(d->nframes);
+  SAMPLETYPE *data = new SAMPLETYPE[nframes * d->channels];
+  d->nframes = resampler.process(d->frames, d->nframes, d->channels, data);
+  delete[] d->frames;
+  d->frames = data;
+}
+
+// Read the first frames of the sample file, converted to the channel
+// layout & rate of the pcm. Not shared yet, so it can still be changed
+static sample_data *readAudio(sample *s, long int nframes, unsigned int rate)
+{
+  WavInFile *wf = s->file;
+  SAMPLETYPE *frames = new SAMPLETYPE[nframes * wf->getNumChannels()];
+  nframes = wf->readFrames(0, nframes, frames);
+
+  sample_data *d = sample_data_new(frames, wf->getNumChannels(), nframes);
+  normaliseChannels(d, wf->getChannelMask());
+  convertRate(d, wf->getSampleRate(), rate);
+  s->rate = rate;
+  return d;
+}
+
+// 'name' in directory 'dir', either may be empty
+static string joinPath(const string &dir, const string &name)
+{
+  if (dir.empty() || name.empty()){
+    return dir + name;
+  }
+  return (dir[dir.size() - 1] == '/') ? dir + name : dir + "/" + name;
+}
+
+static bool isWavFile(const string &name)
+{
+  return (name.size() > 4) && (strcasecmp(name.c_str() + name.size() - 4, ".wav") == 0);
+}
+
+// detected tempo of sample audio, 0 if none was found
+static int detectBpm(const sample_data *d, unsigned int rate)
+{
+  int nChannels = d->channels;
+
+  // init bpm analyzer
+  BPMDetect bpm(nChannels, rate);
+
+  int framesPerBuff = BUFF_SIZE / nChannels;
+  for (long int pos = 0; pos < d->nframes; pos += framesPerBuff){
+    int num = min((long int)framesPerBuff, d->nframes - pos);
+
+    // Enter the new samples to the bpm analyzer class
+    bpm.inputSamples(&d->frames[pos * nChannels], num);
+  }
+  return (int)bpm.getBpm();
+}
+
+// Point a snippet at its head in the preview pack, packing the head first
+// if the file is new or changed since. Without a pack the head is kept in
+// memory. The file is only kept open if its head isn't in the pack
+static bool loadPreview(ctx *ctx, sample *s, const char *name, const struct stat *st)
+{
+  preview_pack *pack = &ctx->pack;
+  int i = ctx->use_pack ? pack_find(pack, name) : -1;
+
+  if ((i < 0) || !pack_fresh(pack, i, st->st_size, st->st_mtime)){
+    WavInFile *wf;
+    try {
+      wf = new WavInFile(s->path.c_str());
+    } catch (const runtime_error &e) {
+      fprintf(stderr, "%s: %s\n", s->path.c_str(), e.what());
+      return false;
+    }
+    s->file = wf;
+    s->bits = wf->getNumBits();
+
+    // read preview frames
+    long int nframes = min((long int)PREVIEW_FRAMES, (long int)wf->getNumSamples());
+    sample_data *d = readAudio(s, nframes, ctx->rate);
+
+    // a changed file gets a new record, the old head may still be playing
+    if (i >= 0){
+      pack_drop(pack, i);
+    }
+    // browsing sorts & filters by the tempo of the head
+    int bpm = detectBpm(d, ctx->rate);
+    i = ctx->use_pack ? pack_reserve(pack, name) : -1;
+    if (i < 0){
+      s->audio = d;
+      s->loaded = (nframes == (long int)wf->getNumSamples());
+      s->bpm = bpm;
+      s->duration = (float)wf->getNumSamples() / wf->getSampleRate();
+      printf("Read %s\n", s->path.c_str());
+      return true;
+    }
+
+    // conversion to the pcm rate can make the head longer than its slot
+    pack_entry *e = pack_entry_at(pack, i);
+    long int head = min(d->nframes, (long int)PREVIEW_FRAMES);
+    memcpy(pack_head(pack, i), d->frames, head * d->channels * sizeof(SAMPLETYPE));
+    e->file_rate = wf->getSampleRate();
+    e->file_channels = wf->getNumChannels();
+    e->bits = wf->getNumBits();
+    e->file_frames = wf->getNumSamples();
+    e->head_channels = d->channels;
+    e->head_frames = head;
+    e->bpm = bpm;
+    // fresh once the head is complete
+    e->mtime = st->st_mtime;
+    e->size = st->st_size;
+
+    // never shared, freed right away by this thread
+    vector<sample_data *> unused;
+    sample_data_release(&unused, d);
+    sample_data_reclaim(&unused);
+    delete wf;
+    s->file = NULL;
+    printf("Packed %s\n", s->path.c_str());
+  }
+
+  const pack_entry *e = pack_entry_at(pack, i);
+  s->rate = ctx->rate;
+  s->bits = e->bits;
+  s->bpm = (int)e->bpm;
+  s->duration = (float)e->file_frames / e->file_rate;
+  s->audio = sample_data_borrow(pack_head(pack, i), e->head_channels, e->head_frames);
+  return true;
+}
+
+// (re)load the snippet of a file, a snippet it replaces is handed to the
+// midi thread to free
+static void addSnippet(ctx *ctx, const string &name)
+{
+  string p = joinPath(ctx->library_path, name);
+  struct stat st;
+  if ((stat(p.c_str(), &st) != 0) || !S_ISREG(st.st_mode)){
+    return;
+  }
+
+  // init sample 
+  struct sample *s = new sample();
+  s->file = NULL;
+  s->owns_file = false;
+  s->path = p;
+  s->audio = NULL;
+  s->loaded = false;
+  s->bpm = 0;
+  s->low_key = 0;
+  s->file_size = st.st_size;
+  s->file_mtime = st.st_mtime;
+  if (!loadPreview(ctx, s, name.c_str(), &st)){
+    delete s;
+    return;
+  }
+
+  sample *&entry = ctx->library[name];
+  if (entry != NULL){
+    ctx->library_removed.push_back(entry);
+  }
+  entry = s;
+}
+
+// drop the snippets of a file, or of all files below a directory
+static void removeSnippets(ctx *ctx, const string &name, bool dir)
+{
+  string prefix = dir ? name + "/" : name;
+  map<string, sample *>::iterator it = ctx->library.lower_bound(prefix);
+  while ((it != ctx->library.end()) && (it->first.compare(0, prefix.size(), prefix) == 0)){
+    if (!dir && (it->first != name)){
+      break;
+    }
+    if (ctx->use_pack){
+      int i = pack_find(&ctx->pack, it->first.c_str());
+      if (i >= 0){
+        pack_drop(&ctx->pack, i);
+      }
+    }
+    ctx->library_removed.push_back(it->second);
+    ctx->library.erase(it++);
+  }
+  if (dir){
+    for (unordered_map<int, string>::iterator w = ctx->watches.begin(); w != ctx->watches.end(); ){
+      if ((w->second == name) || (w->second.compare(0, prefix.size(), prefix) == 0)){
+        inotify_rm_watch(ctx->inotify_fd, w->first);
+        w = ctx->watches.erase(w);
+      } else {
+        w++;
+      }
+    }
+  }
+}
+
+// true if the snippet of a file was made from it as it is now
+static bool snippetFresh(ctx *ctx, const string &name)
 {
+  map<string, sample *>::iterator it = ctx->library.find(name);
+  struct stat st;
+  return (it != ctx->library.end()) &&
+    (stat(joinPath(ctx->library_path, name).c_str(), &st) == 0) &&
+    (st.st_size == it->second->file_size) && (st.st_mtime == it->second->file_mtime);
+}
+
+// add the wav files below a directory of the library, watching every
+// directory for changes. Hidden files & directories are skipped, as are
+// files whose snippet is fresh. Paths found are added to 'seen' if given
+static void scanDirectory(ctx *ctx, const string &dir, set<string> *seen)
+{
+  string p = joinPath(ctx->library_path, dir);
+  if (ctx->inotify_fd >= 0){
+    int wd = inotify_add_watch(ctx->inotify_fd, p.c_str(), WATCH_EVENTS);
+    if (wd >= 0){
+      ctx->watches[wd] = dir;
+    }
+  }
 
-  // open snippets...
-  DIR *dir;
+  DIR *d = opendir(p.c_str());
+  if (d == NULL) {
+    fprintf(stderr, "Unable to open dir %s\n", p.c_str());
+    return;
+  }
   struct dirent *ent;
-  char *path = params->samplePath;
-  dir = opendir(path);
-  if (dir == NULL) {
-    fprintf(stderr, "Unable to open dir %s\n", path);
-    return -1;
+  while ((ent = readdir(d)) != NULL){
+    if (ent->d_name[0] == '.'){
+      continue;
+    }
+    string name = joinPath(dir, ent->d_name);
+
+    // symlinked directories aren't followed, they could loop
+    struct stat st;
+    if (lstat(joinPath(ctx->library_path, name).c_str(), &st) != 0){
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)){
+      if (seen != NULL){
+        seen->insert(name);
+      }
+      scanDirectory(ctx, name, seen);
+    } else if (isWavFile(name)){
+      if (seen != NULL){
+        seen->insert(name);
+      }
+      if (!snippetFresh(ctx, name)){
+        addSnippet(ctx, name);
+      }
+    }
+  }
+  closedir(d);
+}
+
+// hand the current library to the midi thread. A list it hasn't taken yet
+// is replaced, the snippets removed since are carried over
+static void publishSnippets(ctx *ctx)
+{
+  snippet_list *l = new snippet_list();
+  l->samples.reserve(ctx->library.size());
+  for (map<string, sample *>::iterator it = ctx->library.begin(); it != ctx->library.end(); it++){
+    l->samples.push_back(it->second);
   }
-  do {
-    ent = readdir(dir);
-    if (ent != NULL){
-      char *fname = ent->d_name;
-      if (strstr(fname, ".wav") != NULL){
-        string p(path);
-        p.append(fname);
-        WavInFile *wf = new WavInFile(p.c_str());
-        
-        // init sample 
-        struct sample *s = new sample();
-        s->file = wf;
-        s->buffers = new vector<SAMPLETYPE*>(0);
-				s->low_key = 0;
-
-        // read preview frames to memory
-        // TODO: make it a slice
-        int previewCount = 100;
-        while ((wf->eof() == 0) && (previewCount-- > 0)){
-          int num;
-          SAMPLETYPE *buff = new SAMPLETYPE[BUFF_SIZE];
-          num = wf->read(buff, BUFF_SIZE);
-          s->buffers->push_back(buff);
 
-        }
+  snippet_list *skipped = ctx->pending_snippets.exchange(NULL);
+  if (skipped != NULL){
+    l->removed.swap(skipped->removed);
+    delete skipped;
+  }
+  l->removed.insert(l->removed.end(), ctx->library_removed.begin(), ctx->library_removed.end());
+  ctx->library_removed.clear();
+  ctx->pending_snippets.store(l);
+}
+
+// Pick up the changes a watch lost when its queue overflowed: files new or
+// changed since their snippet are loaded & snippets & watches of paths gone
+// are dropped
+static void rescanLibrary(ctx *ctx)
+{
+  set<string> seen;
+  scanDirectory(ctx, "", &seen);
+
+  vector<string> gone;
+  for (map<string, sample *>::iterator it = ctx->library.begin(); it != ctx->library.end(); it++){
+    if (seen.count(it->first) == 0){
+      gone.push_back(it->first);
+    }
+  }
+  for (size_t i = 0; i < gone.size(); i++){
+    removeSnippets(ctx, gone[i], false);
+  }
+  for (unordered_map<int, string>::iterator w = ctx->watches.begin(); w != ctx->watches.end(); ){
+    if (!w->second.empty() && (seen.count(w->second) == 0)){
+      inotify_rm_watch(ctx->inotify_fd, w->first);
+      w = ctx->watches.erase(w);
+    } else {
+      w++;
+    }
+  }
+  printf("Library: %zu samples\n", ctx->library.size());
+}
+
+// Scans the library, then follows changes to it as they are made
+static void libraryThread(ctx *ctx)
+{
+  scanDirectory(ctx, "", NULL);
+  publishSnippets(ctx);
+  printf("Library: %zu samples\n", ctx->library.size());
+  if (ctx->inotify_fd < 0){
+    return;
+  }
 
-        printf("Read %s\n", p.c_str());
+  char buf[16 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+  while (1){
+    ssize_t len = read(ctx->inotify_fd, buf, sizeof(buf));
+    if (len <= 0){
+      if ((len < 0) && (errno == EINTR)){
+        continue;
+      }
+      fprintf(stderr, "Library watch failed: %s\n", strerror(errno));
+      return;
+    }
 
-        // add sample to context
-        ctx->snippets.push_back(s);
+    // one new list per batch of changes
+    bool changed = false;
+    for (char *e = buf; e < buf + len; ){
+      const struct inotify_event *ev = (const struct inotify_event *)e;
+      e += sizeof(struct inotify_event) + ev->len;
+
+      if (ev->mask & IN_Q_OVERFLOW){
+        fprintf(stderr, "Library watch overflowed, rescanning\n");
+        rescanLibrary(ctx);
+        changed = true;
+        continue;
+      }
+      unordered_map<int, string>::iterator w = ctx->watches.find(ev->wd);
+      if (w == ctx->watches.end()){
+        continue;
+      }
+      if (ev->mask & IN_IGNORED){
+        ctx->watches.erase(w);
+        continue;
+      }
+      if ((ev->len == 0) || (ev->name[0] == '.')){
+        continue;
+      }
+      string name = joinPath(w->second, ev->name);
+
+      if (ev->mask & IN_ISDIR){
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO)){
+          scanDirectory(ctx, name, NULL);
+          changed = true;
+        } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)){
+          removeSnippets(ctx, name, true);
+          changed = true;
+        }
+      } else if (isWavFile(name)){
+        // written files are picked up when closed
+        if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)){
+          addSnippet(ctx, name);
+          changed = true;
+        } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)){
+          removeSnippets(ctx, name, false);
+          changed = true;
+        }
       }
     }
-  } while (ent != NULL);
+    if (changed){
+      publishSnippets(ctx);
+    }
+  }
+}
+
+// Open the preview pack & the watch of the sample directory, the library
+// thread scans it
+static int openFiles(struct ctx *ctx, const RunParameters *params)
+{
+  ctx->library_path = params->samplePath;
+  struct stat st;
+  if ((stat(ctx->library_path.c_str(), &st) != 0) || !S_ISDIR(st.st_mode)){
+    fprintf(stderr, "Unable to open dir %s\n", params->samplePath);
+    return -1;
+  }
+
+  string packPath = joinPath(ctx->library_path, PACK_FILE);
+  ctx->use_pack = pack_open(&ctx->pack, packPath.c_str(), ctx->rate, PREVIEW_FRAMES);
+  if (!ctx->use_pack){
+    fprintf(stderr, "Could not open %s, previews are kept in memory\n", packPath.c_str());
+  }
+
+  ctx->inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (ctx->inotify_fd < 0){
+    fprintf(stderr, "Could not watch %s, new samples need a restart\n", params->samplePath);
+  }
 
-  closedir (dir);
+  ctx->snippets = new snippet_list();
+  ctx->pending_snippets = NULL;
   return 0;
 }
 
-// re-populate the sample buffers
-void loadSelectedSnippet(ctx *ctx){
+// hand the file of 's' over to a channel sharing it, the file is closed if
+// no channel does
+static void releaseFile(ctx *ctx, sample *s)
+{
+  if (s->file == NULL){
+    return;
+  }
+  for (int i = 0; i < MAX_SAMPLES; i++){
+    sample *c = &ctx->samples[i];
+    if ((c != s) && (c->file == s->file)){
+      c->owns_file = true;
+      return;
+    }
+  }
+  delete s->file;
+}
 
-  // get selected snippet
-  sample *s;
-	if (ctx->selectedSample != NULL){
-		s = ctx->selectedSample;
-  } else if (ctx->snippets.size() > 0){
-		s = ctx->snippets.at(0);
-	} else {
-	 	fprintf (stderr, "Could not select a sample to load\n");
-		return;
-	}
+// free a snippet dropped from the library, voices keep the audio they play
+static void freeSnippet(ctx *ctx, sample *s)
+{
+  if (ctx->selectedSample == s){
+    ctx->selectedSample = NULL;
+  }
+  sample_data_release(&ctx->retired_audio, s->audio);
+  // channels loaded from the snippet share its file
+  releaseFile(ctx, s);
+  delete s;
+}
+
+// filter & sort the snippets into the catalogue. The list is in name order,
+// which a multimap keeps within a tempo or length
+static void buildCatalogue(ctx *ctx)
+{
+  const vector<sample *> &snippets = ctx->snippets->samples;
+  bool filter = (ctx->bpm_min > 0) || (ctx->bpm_max > 0);
+
+  multimap<float, sample *> sorted;
+  for (size_t i = 0; i < snippets.size(); i++){
+    sample *s = snippets[i];
+    if (filter && ((s->bpm <= 0) || (s->bpm < ctx->bpm_min) ||
+          ((ctx->bpm_max > 0) && (s->bpm > ctx->bpm_max)))){
+      continue;
+    }
+    float key = (ctx->order == ORDER_BPM) ? s->bpm :
+      ((ctx->order == ORDER_DURATION) ? s->duration : 0);
+    sorted.insert(sorted.end(), make_pair(key, s));
+  }
+
+  ctx->catalogue.clear();
+  ctx->catalogue.reserve(sorted.size());
+  for (multimap<float, sample *>::iterator it = sorted.begin(); it != sorted.end(); it++){
+    ctx->catalogue.push_back(it->second);
+  }
+
+  int banks = max(1, (int)((ctx->catalogue.size() + BANK_KEYS - 1) / BANK_KEYS));
+  ctx->bank = min(ctx->bank, banks - 1);
+}
+
+// show bank 'bank' of the catalogue
+static void selectBank(ctx *ctx, int bank)
+{
+  int banks = max(1, (int)((ctx->catalogue.size() + BANK_KEYS - 1) / BANK_KEYS));
+  ctx->bank = max(0, min(bank, banks - 1));
+
+  size_t first = ctx->bank * BANK_KEYS;
+  size_t last = min(first + BANK_KEYS, ctx->catalogue.size());
+  if (first < last){
+    printf("Bank %d/%d: %s .. %s\n", ctx->bank + 1, banks,
+        ctx->catalogue[first]->path.c_str(), ctx->catalogue[last - 1]->path.c_str());
+  } else {
+    printf("Bank %d/%d: empty\n", ctx->bank + 1, banks);
+  }
+}
+
+// snippet of a key in the current bank, NULL if the bank has none there
+static sample *bankSnippet(ctx *ctx, int note)
+{
+  int key = ((note - BANK_LOW_KEY) % BANK_KEYS + BANK_KEYS) % BANK_KEYS;
+  size_t index = ctx->bank * BANK_KEYS + key;
+  return (index < ctx->catalogue.size()) ? ctx->catalogue[index] : NULL;
+}
+
+// take the latest list of snippets from the library thread
+static void takeSnippets(ctx *ctx)
+{
+  snippet_list *l = ctx->pending_snippets.exchange(NULL);
+  if (l == NULL){
+    return;
+  }
+  for (size_t i = 0; i < l->removed.size(); i++){
+    freeSnippet(ctx, l->removed[i]);
+  }
+  l->removed.clear();
+  delete ctx->snippets;
+  ctx->snippets = l;
+  buildCatalogue(ctx);
+}
+
+// map cue points & loops of the file onto keys starting from lowest key,
+// each slice playing until the next marker or to end of its loop.
+// slices already edited by hand are kept
+static void importSlices(sample *s)
+{
+  const vector<WavMarker> &markers = s->file->getMarkers();
+  if ((markers.size() == 0) || (s->low_key != 0)){
+    return;
+  }
+
+  memset(s->slices, 0, sizeof(s->slices));
+  s->selectedSlice = NULL;
+  s->low_key = SUPER_LOW_KEY;
+
+  // markers are in frames of the file, sample data may have been converted
+  double scale = (double)s->rate / s->file->getSampleRate();
+  long unsigned int nframes = s->audio->nframes;
+
+  int key = s->low_key;
+  for (size_t i = 0; (i < markers.size()) && (key < MAX_SLICES); i++, key++){
+    slice *slc = &s->slices[key];
+    slc->start = min((long unsigned int)(markers[i].frame * scale), nframes);
+    if (markers[i].length > 0){
+      slc->end = slc->start + (long unsigned int)(markers[i].length * scale);
+    } else if (i + 1 < markers.size()){
+      slc->end = (long unsigned int)(markers[i+1].frame * scale);
+    } else {
+      slc->end = nframes;
+    }
+    slc->end = min(slc->end, nframes);
+  }
+  printf("Imported %d slices\n", key - s->low_key);
+}
 
-  // prepare sample
-  if (s->buffers != NULL && s->buffers->size() > 0){
-    delete s->buffers;
+// drop a slice table & its references, once the audio thread can't be
+// reading it
+static void releaseTable(ctx *ctx, const slice_map *m)
+{
+  sample_data_release(&ctx->retired_audio, m->audio);
+  for (int key = 0; key < MAX_SLICES; key++){
+    sample_data_release(&ctx->retired_audio, m->heads[key]);
   }
-  s->buffers = new vector<SAMPLETYPE*>(0);
-	s->file->rewind();
+  delete m;
+}
 
-  // unload sample currently loaded
-  // for selected channel 
-  sample *chan_sample = &ctx->samples[ctx->midi_chan];
-  if ( chan_sample->buffers != NULL){
-    if (chan_sample->buffers->size() > 0){
-      delete chan_sample->buffers;
+// free slice tables the audio thread can no longer be reading & audio
+// no voice refers to anymore
+static void reclaimRetired(ctx *ctx)
+{
+  unsigned int epoch = ctx->audio_epoch.load();
+  size_t kept = 0;
+  for (size_t i = 0; i < ctx->retired_maps.size(); i++){
+    if (ctx->retired_maps[i].second != epoch){
+      releaseTable(ctx, ctx->retired_maps[i].first);
+    } else {
+      ctx->retired_maps[kept++] = ctx->retired_maps[i];
     }
-    // TODO: rm slices
-    //for (int i = 0; i < MAX_SLICES; i++){
-    //  chan_sample[i]->start = 0;
-    //}
   }
+  ctx->retired_maps.resize(kept);
 
+  kept = 0;
+  for (size_t i = 0; i < ctx->retired_patterns.size(); i++){
+    if (ctx->retired_patterns[i].second != epoch){
+      delete ctx->retired_patterns[i].first;
+    } else {
+      ctx->retired_patterns[kept++] = ctx->retired_patterns[i];
+    }
+  }
+  ctx->retired_patterns.resize(kept);
 
-  // init bpm analyzer
-  int nChannels = (int)s->file->getNumChannels();
-  BPMDetect bpm(nChannels, s->file->getSampleRate());
-  
-  while (s->file->eof() == 0){
-    int num;
-    SAMPLETYPE *buff = new SAMPLETYPE[BUFF_SIZE];
-    num = s->file->read(buff, BUFF_SIZE);
-    s->buffers->push_back(buff);
+  sample_data_reclaim(&ctx->retired_audio);
+}
 
-    // Enter the new samples to the bpm analyzer class
-    bpm.inputSamples(buff, num / nChannels);
+// Tempo factor that plays a sample of given bpm at the session bpm. The
+// detected tempo may be off by an octave, so it is taken in the octave
+// closest to the session
+static float match_ratio(float session_bpm, float bpm)
+{
+  if ((bpm <= 0) || (session_bpm <= 0)){
+    return 1.0f;
+  }
+  while (bpm < session_bpm * 0.75f){
+    bpm *= 2;
+  }
+  while (bpm >= session_bpm * 1.5f){
+    bpm /= 2;
+  }
+  return session_bpm / bpm;
+}
+
+// tempo stretched voices of a sample of 'bpm' play at for tempo modulation 'tempo'
+static float stretch_tempo(ctx *ctx, float tempo, float bpm)
+{
+  float t = 1.0f + tempo / 100.0f;
+  if (ctx->tempo_match.load()){
+    t *= match_ratio(ctx->seq_bpm.load(), bpm);
+  }
+  return t;
+}
+
+// Set the heads of the slices of a table to be made at the modulation set by
+// the controllers. Heads of regions the old table of the channel had at the
+// same settings are shared, so a nudge renders one head
+// \return true if heads are left to render
+static bool shareHeads(ctx *ctx, slice_map *m, const slice_map *old)
+{
+  m->head_tempo = stretch_tempo(ctx, ctx->tempo.target.load(), m->bpm);
+  m->head_pitch = ctx->pitch.target.load();
+  m->head_rate = ctx->rate_change.target.load();
+  bool same = (old != NULL) && (old->audio == m->audio) &&
+    (old->head_tempo == m->head_tempo) && (old->head_pitch == m->head_pitch) &&
+    (old->head_rate == m->head_rate);
+
+  bool missing = false;
+  for (int key = 0; key < MAX_SLICES; key++){
+    m->heads[key] = NULL;
+    if (m->end[key] <= m->start[key]){
+      continue;
+    }
+    if (same && (old->heads[key] != NULL) && (old->start[key] == m->start[key]) &&
+        (old->end[key] == m->end[key])){
+      m->heads[key] = old->heads[key];
+      sample_data_ref(m->heads[key]);
+      continue;
+    }
+    missing = true;
+  }
+  return missing;
+}
+
+// Queue a head job for the head thread
+static bool push_head_job(head_queue *q, head_job *job)
+{
+  unsigned int head = q->head.load(memory_order_relaxed);
+  if (head - q->tail.load(memory_order_acquire) >= MAX_HEAD_JOBS){
+    return false;
+  }
+  q->jobs[head % MAX_HEAD_JOBS] = job;
+  q->head.store(head + 1, memory_order_release);
+  return true;
+}
+
+// Take the oldest finished head job
+static bool pop_head_job(head_queue *q, head_job **job)
+{
+  unsigned int tail = q->tail.load(memory_order_relaxed);
+  if (tail == q->head.load(memory_order_acquire)){
+    return false;
+  }
+  *job = q->jobs[tail % MAX_HEAD_JOBS];
+  q->tail.store(tail + 1, memory_order_release);
+  return true;
+}
+
+static void wakeFd(int fd)
+{
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) < 0){
+    fprintf(stderr, "Could not wake thread: %s\n", strerror(errno));
+  }
+}
+
+// Hand a copy of the latest table of a channel to the head thread to render
+// its missing heads. A job the head thread hasn't started on is dropped
+static void requestHeads(ctx *ctx, int chan, const slice_map *m)
+{
+  head_job *job = new head_job();
+  job->channel = chan;
+  job->version = ctx->slice_versions[chan].load();
+  job->done = false;
+  job->table = new slice_map(*m);
+  sample_data_ref(job->table->audio);
+  for (int key = 0; key < MAX_SLICES; key++){
+    if (job->table->heads[key] != NULL){
+      sample_data_ref(job->table->heads[key]);
+    }
+  }
+
+  head_job *skipped = ctx->head_jobs[chan].exchange(job);
+  if (skipped != NULL){
+    releaseTable(ctx, skipped->table);
+    delete skipped;
+  }
+  wakeFd(ctx->head_wake_fd);
+}
+
+// Swap in the tables the head thread rendered heads for, unless the channel
+// has a newer table by now
+static void takeHeads(ctx *ctx)
+{
+  uint64_t n;
+  if ((read(ctx->heads_ready_fd, &n, sizeof(n)) < 0) && (errno != EAGAIN)){
+    fprintf(stderr, "Could not take heads: %s\n", strerror(errno));
+  }
+
+  head_job *job;
+  while (pop_head_job(&ctx->finished_heads, &job)){
+    int chan = job->channel;
+    if (job->done && (ctx->slice_versions[chan].load() == job->version)){
+      const slice_map *old = ctx->slice_maps[chan].exchange(job->table);
+      if (old != NULL){
+        ctx->retired_maps.push_back(make_pair(old, ctx->audio_epoch.load()));
+      }
+    } else {
+      releaseTable(ctx, job->table);
+    }
+    delete job;
+  }
+  reclaimRetired(ctx);
+}
+
+// Render the heads missing from the table of a job through the primer at
+// the settings of the table. Gives up once the midi thread published a
+// newer table of the channel
+// \return true if all heads were rendered
+static bool renderHeads(ctx *ctx, head_job *job)
+{
+  slice_map *m = job->table;
+  SoundTouch *st = &ctx->primer;
+  st->setTempo(m->head_tempo);
+  st->setPitchSemiTones(m->head_pitch);
+  st->setRateChange(m->head_rate);
+  ctx->head_latency = st->getSetting(SETTING_INITIAL_LATENCY);
+  for (int key = 0; key < MAX_SLICES; key++){
+    if ((m->end[key] <= m->start[key]) || (m->heads[key] != NULL)){
+      continue;
+    }
+    if (ctx->slice_versions[job->channel].load() != job->version){
+      return false;
+    }
+    SAMPLETYPE *frames = new SAMPLETYPE[PRIME_HEAD_FRAMES * CHANNELS];
+    long int n = voice_render_head(st, m->audio, m->start[key], m->end[key],
+        frames, PRIME_HEAD_FRAMES);
+    m->heads[key] = sample_data_new(frames, CHANNELS, n);
+  }
+  return true;
+}
+
+// Render the heads of the tables handed over by the midi thread, off the
+// midi thread so that notes & controllers aren't held up by sample loads.
+// Jobs go back to the midi thread rendered or not, it frees what it
+// doesn't publish
+static void headThread(ctx *ctx)
+{
+  while (1){
+    for (int chan = 0; chan < MAX_SAMPLES; chan++){
+      head_job *job = ctx->head_jobs[chan].exchange(NULL);
+      if (job == NULL){
+        continue;
+      }
+      job->done = renderHeads(ctx, job);
+      while (!push_head_job(&ctx->finished_heads, job)){
+        usleep(1000);
+      }
+      wakeFd(ctx->heads_ready_fd);
+    }
+
+    uint64_t n;
+    if ((read(ctx->head_wake_fd, &n, sizeof(n)) < 0) && (errno != EINTR)){
+      fprintf(stderr, "Head thread failed: %s\n", strerror(errno));
+      return;
+    }
+  }
+}
+
+// resolve slices of the sample on a channel into a new table and swap it in
+static void publishSlices(ctx *ctx, int chan)
+{
+  sample *s = &ctx->samples[chan];
+  slice_map *m = NULL;
+  bool missing = false;
+
+  if (s->audio != NULL){
+    m = new slice_map();
+    m->audio = s->audio;
+    m->bpm = s->bpm;
+    sample_data_ref(m->audio);
+
+    long int nFrames = s->audio->nframes;
+    long int last_end = 0;
+    for (int key = 0; key < MAX_SLICES; key++){
+      slice *slc = &s->slices[key];
+      // if slice interval is not set then start at
+      // end of closest lower key with an interval
+      long int origin = slc->start;
+      if ((origin == 0) && (key > s->low_key)){
+        origin = last_end;
+      }
+      if (slc->end > 0){
+        last_end = slc->end;
+      }
+
+      long int start = origin + slc->start_offset;
+      long int end = slc->end + slc->end_offset;
+      m->origin[key] = origin;
+      m->start[key] = max(0L, min(start, nFrames));
+      m->end[key] = max(m->start[key], min(end, nFrames));
+    }
+    missing = shareHeads(ctx, m, ctx->slice_maps[chan].load());
+  }
+
+  ctx->slice_versions[chan]++;
+  const slice_map *old = ctx->slice_maps[chan].exchange(m);
+  if (old != NULL){
+    ctx->retired_maps.push_back(make_pair(old, ctx->audio_epoch.load()));
+  }
+  if (missing){
+    requestHeads(ctx, chan, m);
+  }
+  reclaimRetired(ctx);
+}
+
+// swap in a copy of the edited pattern of a channel
+static void publishPattern(ctx *ctx, int chan)
+{
+  const seq_pattern *p = new seq_pattern(ctx->edit_patterns[chan]);
+  const seq_pattern *old = ctx->patterns[chan].exchange(p);
+  if (old != NULL){
+    ctx->retired_patterns.push_back(make_pair(old, ctx->audio_epoch.load()));
+  }
+  reclaimRetired(ctx);
+}
+
+// channel of the selected sample, -1 for browse snippets
+static int selectedChannel(ctx *ctx)
+{
+  sample *s = ctx->selectedSample;
+  if ((s >= &ctx->samples[0]) && (s < &ctx->samples[MAX_SAMPLES])){
+    return (int)(s - ctx->samples);
+  }
+  return -1;
+}
+
+// write the selected sample with its slices as cue points
+static void saveSelectedSample(ctx *ctx)
+{
+  sample *s = ctx->selectedSample;
+  if ((s == NULL) || (s->audio == NULL) || (s->file == NULL)){
+    fprintf(stderr, "No sample to save\n");
+    return;
+  }
+
+  string p(s->path);
+  size_t ext = p.rfind(".wav");
+  p.insert((ext == string::npos) ? p.size() : ext, "-sliced");
+
+  try {
+    WavOutFile out(p.c_str(), s->rate, s->bits, s->audio->channels);
+    out.write(s->audio->frames, s->audio->nframes * s->audio->channels);
+    for (int key = s->low_key; key < MAX_SLICES; key++){
+      slice *slc = &s->slices[key];
+      if (slc->end == 0){
+        continue;
+      }
+      long int start = slc->start + slc->start_offset;
+      out.addCuePoint(max(0L, start));
+    }
+  } catch (const runtime_error &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return;
+  }
+  printf("Saved %s\n", p.c_str());
+}
+
+// copy sample to a channel, voices on the channel keep the audio they play
+static void setChannelSample(ctx *ctx, int chan, sample *s)
+{
+  sample *c = &ctx->samples[chan];
+  if (c == s){
+    publishSlices(ctx, chan);
+    return;
+  }
+  sample_data *old = c->audio;
+  // a file the channel took over from its freed snippet stays with the
+  // channel if reloaded from another channel sharing it
+  bool owns = c->owns_file && (c->file == s->file);
+  if (c->owns_file && !owns){
+    releaseFile(ctx, c);
+  }
+  *c = *s;
+  c->owns_file = owns;
+  sample_data_ref(c->audio);
+  sample_data_release(&ctx->retired_audio, old);
+  publishSlices(ctx, chan);
+}
+
+// re-populate the sample buffers
+void loadSelectedSnippet(ctx *ctx){
+
+  // get selected snippet
+  sample *s;
+	if (ctx->selectedSample != NULL){
+		s = ctx->selectedSample;
+  } else if (ctx->snippets->samples.size() > 0){
+		s = ctx->snippets->samples.at(0);
+	} else {
+	 	fprintf (stderr, "Could not select a sample to load\n");
+		return;
+	}
+
+  // files previewed from the pack are opened on first load
+  if (s->file == NULL){
+    try {
+      s->file = new WavInFile(s->path.c_str());
+    } catch (const runtime_error &e) {
+      fprintf(stderr, "%s: %s\n", s->path.c_str(), e.what());
+      return;
+    }
+    s->bits = s->file->getNumBits();
+  }
+
+  // prepare sample, the preview is replaced by the whole file once.
+  // positioned reads, so the file stream shared with browse mode isn't moved
+  // voices still playing the preview keep it until they finish
+  if (!s->loaded){
+    sample_data *preview = s->audio;
+    s->audio = readAudio(s, s->file->getNumSamples(), ctx->rate);
+    s->loaded = true;
+    sample_data_release(&ctx->retired_audio, preview);
+  }
+  // use slices marked in the file
+  importSlices(s);
+
+  s->bpm = detectBpm(s->audio, s->rate);
+  printf("Loaded on Ch:%d (%d bpm)\n",ctx->midi_chan, s->bpm);
+  if (ctx->seq_bpm_auto && (s->bpm > 0)){
+    ctx->seq_bpm = s->bpm;
+    // samples loaded later are matched to the session tempo instead
+    if (ctx->tempo_match){
+      ctx->seq_bpm_auto = false;
+    }
+  }
+  setChannelSample(ctx, ctx->midi_chan, s);
+}
+
+
+// Open a playback pcm at the rate nearest '*rate', which is set to the rate
+// granted. Rates are converted by the engine, not by the alsa plug layer
+static snd_pcm_t* initPCM(const char *device, int channels, bool nonblock,
+    unsigned int *rate, snd_pcm_uframes_t *granted_buffer){
+
+  // pcm init
+  int pcm;
+  snd_pcm_hw_params_t *params;
+  snd_pcm_t *pcm_handle;
+
+	if ((pcm = snd_pcm_open(&pcm_handle, device, SND_PCM_STREAM_PLAYBACK,
+          nonblock ? SND_PCM_NONBLOCK : 0)) < 0){
+		printf("ERROR: Can't open \"%s\" PCM. %s\n", device, snd_strerror(pcm));
+    return NULL;
+  }
+
+  // aloc params with default values
+  snd_pcm_hw_params_alloca(&params);
+  snd_pcm_hw_params_any(pcm_handle, params);
+
+  // override defaults
+  if ((pcm = snd_pcm_hw_params_set_format(pcm_handle, params,
+        SND_PCM_FORMAT_FLOAT_LE)) < 0)
+    printf("ERROR: Can't set format. %s\n", snd_strerror(pcm));
+
+  if ((pcm = snd_pcm_hw_params_set_access(pcm_handle, params,
+        SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
+    printf("ERROR: Can't set access. %s\n", snd_strerror(pcm));
+
+  if ((pcm = snd_pcm_hw_params_set_channels(pcm_handle, params, channels)) < 0) 
+    printf("ERROR: Can't set channels number. %s\n", snd_strerror(pcm));
+
+  if ((pcm = snd_pcm_hw_params_set_rate_resample(pcm_handle, params, 0)) < 0) 
+    printf("ERROR: Can't disable rate conversion. %s\n", snd_strerror(pcm));
+
+  if ((pcm = snd_pcm_hw_params_set_rate_near(pcm_handle, params, rate, 0)) < 0) 
+    printf("ERROR: Can't set rate. %s\n", snd_strerror(pcm));
+
+
+  snd_pcm_uframes_t period = PERIOD_FRAMES;
+  if ((pcm = snd_pcm_hw_params_set_period_size_near(pcm_handle, params, &period, 0)) < 0) 
+    printf("ERROR: Can't set period size. %s\n", snd_strerror(pcm));
+
+  snd_pcm_uframes_t buffer = PERIOD_FRAMES * NUM_PERIODS;
+  if ((pcm = snd_pcm_hw_params_set_buffer_size_near(pcm_handle, params, &buffer)) < 0) 
+    printf("ERROR: Can't set buffersize. %s\n", snd_strerror(pcm));
+
+  /* Write parameters */
+  if ((pcm = snd_pcm_hw_params(pcm_handle, params)) < 0)
+    printf("ERROR: Can't set harware parameters. %s\n", snd_strerror(pcm));
+
+  snd_pcm_uframes_t   	buffer_size; 
+  snd_pcm_uframes_t   	period_size;
+  snd_pcm_get_params(pcm_handle, &buffer_size, &period_size);
+  printf("PCM %s OPENED WITH: %ld buffer, %ld period, %u rate, %d channels\n", device,
+      buffer_size, period_size, *rate, channels);
+  *granted_buffer = buffer_size;
+
+	if ((pcm = snd_pcm_prepare (pcm_handle)) < 0) {
+	 	fprintf (stderr, "cannot prepare audio interface for use (%s)\n",
+	 					 snd_strerror (pcm));
+	 	exit (1);
+	}
+
+  return pcm_handle;
+}
+
+// Open the pcm of each '-out=device/channels', 'default' in stereo if there are
+// none, & route the midi channels to their buses
+static bool openOutputs(ctx *ctx, const RunParameters *params)
+{
+  vector<string> specs = params->outputs;
+  if (specs.empty()){
+    specs.push_back(PCM_DEVICE);
+  }
+  ctx->rate = params->engineRate;
+
+  ctx->num_outputs = 0;
+  ctx->num_buses = 0;
+  for (size_t i = 0; (i < specs.size()) && (ctx->num_outputs < MAX_OUTPUTS); i++){
+    string device = specs[i];
+    int channels = CHANNELS;
+    size_t slash = device.rfind('/');
+    if (slash != string::npos){
+      channels = atoi(device.c_str() + slash + 1);
+      device.erase(slash);
+    }
+    // whole pairs, as many as there are buses left
+    channels = min(max(CHANNELS, channels & ~1), (MAX_BUSES - ctx->num_buses) * CHANNELS);
+    if (channels < CHANNELS){
+      fprintf(stderr, "No output buses left for %s\n", device.c_str());
+      break;
+    }
+
+    output *out = &ctx->outputs[ctx->num_outputs];
+    unsigned int rate = ctx->rate;
+    snd_pcm_uframes_t buffer_size;
+    out->pcm = initPCM(device.c_str(), channels, (ctx->num_outputs > 0), &rate, &buffer_size);
+    if (out->pcm == NULL){
+      continue;
+    }
+    out->device = device;
+    out->channels = channels;
+    out->first_bus = ctx->num_buses;
+    out->rate = rate;
+    out->buffer = buffer_size;
+    out->frames = NULL;
+    out->resampled = NULL;
+    out->resampling = (rate != ctx->rate) || (ctx->num_outputs > 0);
+    if (out->resampling){
+      stream_init(&out->resampler, ctx->rate, rate, channels, PERIOD_FRAMES);
+      printf("PCM %s converted from %u to %u%s\n", device.c_str(), ctx->rate, rate,
+          (ctx->num_outputs > 0) ? ", following its clock" : "");
+    }
+    out->primed = false;
+    out->drift_ppm = 0;
+    out->xruns = 0;
+    out->dropped = 0;
+    // output latency in frames of the engine
+    if (ctx->num_outputs == 0){
+      ctx->latency = (long int)buffer_size * ctx->rate / rate +
+        (out->resampling ? STREAM_TAPS / 2 : 0);
+    }
+    ctx->num_buses += channels / CHANNELS;
+    ctx->num_outputs++;
+  }
+  if (ctx->num_outputs == 0){
+    return false;
+  }
+
+  // '-route=a,b,..' lists the bus of each channel
+  const char *route = params->routes.c_str();
+  for (int chan = 0; chan < MAX_SAMPLES; chan++){
+    int bus = 0;
+    if (*route != 0){
+      bus = atoi(route);
+      route += strcspn(route, ",");
+      route += (*route == ',') ? 1 : 0;
+    }
+    ctx->routes[chan] = max(0, min(ctx->num_buses - 1, bus));
+  }
+  return true;
+}
+
+// Sets the 'SoundTouch' object up according to input file sound format & 
+// command line parameters
+static void setup(SoundTouch *pSoundTouch, unsigned int rate, const RunParameters *params)
+{
+  pSoundTouch->setSampleRate(rate);
+  pSoundTouch->setChannels(CHANNELS);
+
+  pSoundTouch->setTempoChange(params->tempoDelta);
+  pSoundTouch->setPitchSemiTones(params->pitchDelta);
+  pSoundTouch->setRateChange(params->rateDelta);
+
+  pSoundTouch->setSetting(SETTING_USE_QUICKSEEK, params->quick);
+  pSoundTouch->setSetting(SETTING_USE_AA_FILTER, !(params->noAntiAlias));
+
+  if (params->speech)
+  {
+    // use settings for speech processing
+    pSoundTouch->setSetting(SETTING_SEQUENCE_MS, 40);
+    pSoundTouch->setSetting(SETTING_SEEKWINDOW_MS, 15);
+    pSoundTouch->setSetting(SETTING_OVERLAP_MS, 8);
+    fprintf(stderr, "Tune processing parameters for speech processing.\n");
+  }
+
+  fflush(stderr);
+}
+
+void openMidi(struct ctx *ctx)
+{
+  snd_seq_open(&ctx->seq_handle, "default", SND_SEQ_OPEN_INPUT, 0);
+
+  snd_seq_set_client_name(ctx->seq_handle, "Choppage");
+  int port = snd_seq_create_simple_port(ctx->seq_handle, "Choppage Input",
+      SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE,
+      SND_SEQ_PORT_TYPE_APPLICATION);
+  // polled behind the input, heads finished by the head thread wake the
+  // midi thread too
+  ctx->head_wake_fd = eventfd(0, EFD_CLOEXEC);
+  ctx->heads_ready_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  ctx->num_midi_fds = snd_seq_poll_descriptors_count(ctx->seq_handle, POLLIN);
+  ctx->midi_fds = new pollfd[ctx->num_midi_fds + 1];
+  snd_seq_poll_descriptors(ctx->seq_handle, ctx->midi_fds, ctx->num_midi_fds, POLLIN);
+  ctx->midi_fds[ctx->num_midi_fds].fd = ctx->heads_ready_fd;
+  ctx->midi_fds[ctx->num_midi_fds].events = POLLIN;
+
+  // clock out has its own client, written by the midi thread only.
+  // non blocking so that a full output pool drops ticks instead
+  ctx->seq_out = NULL;
+  if (snd_seq_open(&ctx->seq_out, "default", SND_SEQ_OPEN_OUTPUT, SND_SEQ_NONBLOCK) < 0){
+    printf("Could not open midi clock output\n");
+    ctx->seq_out = NULL;
+    return;
+  }
+  snd_seq_set_client_name(ctx->seq_out, "Choppage Clock");
+  ctx->clock_port = snd_seq_create_simple_port(ctx->seq_out, "Choppage Clock",
+      SND_SEQ_PORT_CAP_READ|SND_SEQ_PORT_CAP_SUBS_READ,
+      SND_SEQ_PORT_TYPE_APPLICATION);
+  ctx->clock_queue = snd_seq_alloc_queue(ctx->seq_out);
+  snd_seq_start_queue(ctx->seq_out, ctx->clock_queue, NULL);
+  snd_seq_drain_output(ctx->seq_out);
+}
+
+// Select slice on given key for editing. The first key played becomes the
+// lowest key, and a key without start keeps the one it follows on from
+static void selectSlice(ctx *ctx, int chan, int note)
+{
+  sample *s = &ctx->samples[chan];
+  slice *slc = &s->slices[note];
+
+  s->selectedSlice = slc;
+  if (s->low_key == 0){
+    s->low_key = note;
+    publishSlices(ctx, chan);
+  } else if (slc->start == 0){
+    slc->start = ctx->slice_maps[chan].load()->origin[note];
+  }
+}
+
+// Queue an event for the other thread
+static bool push_event(event_queue *q, const voice_event *ev)
+{
+  unsigned int head = q->head.load(memory_order_relaxed);
+  if (head - q->tail.load(memory_order_acquire) >= MAX_EVENTS){
+    return false;
+  }
+  q->events[head % MAX_EVENTS] = *ev;
+  q->head.store(head + 1, memory_order_release);
+  return true;
+}
+
+// Take the oldest queued event
+static bool pop_event(event_queue *q, voice_event *ev)
+{
+  unsigned int tail = q->tail.load(memory_order_relaxed);
+  if (tail == q->head.load(memory_order_acquire)){
+    return false;
+  }
+  *ev = q->events[tail % MAX_EVENTS];
+  q->tail.store(tail + 1, memory_order_release);
+  return true;
+}
+
+// Queue a clock message for the midi thread
+static bool push_clock(clock_msg_queue *q, const clock_msg *msg)
+{
+  unsigned int head = q->head.load(memory_order_relaxed);
+  if (head - q->tail.load(memory_order_acquire) >= MAX_CLOCK_MSGS){
+    return false;
+  }
+  q->msgs[head % MAX_CLOCK_MSGS] = *msg;
+  q->head.store(head + 1, memory_order_release);
+  return true;
+}
+
+// Take the oldest queued clock message
+static bool pop_clock(clock_msg_queue *q, clock_msg *msg)
+{
+  unsigned int tail = q->tail.load(memory_order_relaxed);
+  if (tail == q->head.load(memory_order_acquire)){
+    return false;
+  }
+  *msg = q->msgs[tail % MAX_CLOCK_MSGS];
+  q->tail.store(tail + 1, memory_order_release);
+  return true;
+}
+
+// add voice as newest of its channel
+static void link_voice(ctx *ctx, voice *v)
+{
+  int chan = v->channel;
+  v->prev = ctx->chan_newest[chan];
+  v->next = NULL;
+  if (v->prev != NULL){
+    v->prev->next = v;
+  } else {
+    ctx->chan_oldest[chan] = v;
+  }
+  ctx->chan_newest[chan] = v;
+  ctx->chan_voice_count[chan]++;
+  ctx->note_voices[chan][v->note] = v;
+}
+
+static void unlink_voice(ctx *ctx, voice *v)
+{
+  int chan = v->channel;
+  if (v->prev != NULL){
+    v->prev->next = v->next;
+  } else {
+    ctx->chan_oldest[chan] = v->next;
+  }
+  if (v->next != NULL){
+    v->next->prev = v->prev;
+  } else {
+    ctx->chan_newest[chan] = v->prev;
+  }
+  ctx->chan_voice_count[chan]--;
+  if (ctx->note_voices[chan][v->note] == v){
+    ctx->note_voices[chan][v->note] = NULL;
+  }
+}
+
+// return finished voice to the free list
+static void free_voice(ctx *ctx, voice *v)
+{
+  unlink_voice(ctx, v);
+  v->active = false;
+  ctx->free_voices[ctx->num_free_voices++] = v;
+}
+
+// take a free voice. When all are in use, the oldest voice of all
+// channels is cut off and reused
+static voice *take_voice(ctx *ctx)
+{
+  if (ctx->num_free_voices > 0){
+    return ctx->free_voices[--ctx->num_free_voices];
+  }
+
+  voice *oldest = NULL;
+  for (int chan = 0; chan < MAX_SAMPLES; chan++){
+    voice *v = ctx->chan_oldest[chan];
+    if ((v != NULL) &&
+        ((oldest == NULL) || ((int)(ctx->voice_age - v->age) > (int)(ctx->voice_age - oldest->age)))){
+      oldest = v;
+    }
+  }
+  unlink_voice(ctx, oldest);
+  return oldest;
+}
+
+// pick the voice of a full channel to give way for a new note
+static voice *steal_victim(ctx *ctx, int chan, int note)
+{
+  int policy = ctx->steal[chan].load(memory_order_relaxed);
+  if (policy == STEAL_SAME_NOTE){
+    voice *v = ctx->note_voices[chan][note];
+    if ((v != NULL) && (v->env.stage != ENV_RELEASE)){
+      return v;
+    }
+  }
+
+  // prefer voices that aren't fading out already
+  voice *victim = NULL;
+  float victim_level = 0;
+  for (voice *v = ctx->chan_oldest[chan]; v != NULL; v = v->next){
+    if (v->env.stage == ENV_RELEASE){
+      continue;
+    }
+    if (policy != STEAL_QUIETEST){
+      return v;
+    }
+    float level = v->env.level * v->gain;
+    if ((victim == NULL) || (level < victim_level)){
+      victim = v;
+      victim_level = level;
+    }
+  }
+  return victim;
+}
+
+// modulation of a voice by its mode, voices played as recorded ignore it
+static void apply_fx(ctx *ctx, voice *v)
+{
+  if (v->mode == VOICE_DIRECT){
+    return;
+  }
+  float pitch = ctx->pitch.value + v->transpose;
+  float tempo = stretch_tempo(ctx, ctx->tempo.value, v->bpm);
+  if (v->mode == VOICE_VARISPEED){
+    // tempo, pitch & rate all change the speed, pitch goes with tempo
+    v->speed = tempo * powf(2.0f, pitch / 12.0f) *
+      (1.0f + ctx->rate_change.value / 100.0f);
+    return;
+  }
+  v->st.setTempo(tempo);
+  v->st.setPitchSemiTones(pitch);
+  v->st.setRateChange(ctx->rate_change.value);
+}
+
+// transposed notes of a channel played as recorded go by varispeed
+static voice_mode channel_voice_mode(ctx *ctx, int chan, float transpose)
+{
+  switch (ctx->fx[chan].mode.load(memory_order_relaxed)){
+    case ST_PASSTHROUGH:
+      return (transpose == 0) ? VOICE_DIRECT : VOICE_VARISPEED;
+    case ST_MACHINE:
+      return VOICE_VARISPEED;
+    default:
+      return VOICE_STRETCH;
+  }
+}
+
+// envelope voices of a channel start with
+static adsr channel_env(ctx *ctx, int chan)
+{
+  const env_ctl *e = &ctx->envs[chan];
+  adsr a;
+  a.attack = e->attack.load(memory_order_relaxed);
+  a.decay = e->decay.load(memory_order_relaxed);
+  a.sustain = e->sustain.load(memory_order_relaxed);
+  a.release = e->release.load(memory_order_relaxed);
+  return a;
+}
+
+// head of the slice of an event if it was made at the settings of the voice
+static sample_data *slice_head(ctx *ctx, const slice_map *m, const voice_event *ev, const voice *v)
+{
+  if ((m == NULL) || (v->mode != VOICE_STRETCH) || ev->to_end || (v->transpose != 0)){
+    return NULL;
+  }
+  if ((stretch_tempo(ctx, ctx->tempo.value, m->bpm) != m->head_tempo) ||
+      (ctx->pitch.value != m->head_pitch) || (ctx->rate_change.value != m->head_rate)){
+    return NULL;
+  }
+  return m->heads[ev->slice];
+}
+
+static void handle_event(ctx *ctx, const voice_event *ev)
+{
+  int chan = ev->channel;
+
+  if ((ev->type == EV_NOTE_ON) || (ev->type == EV_SLICE_ON)){
+    sample_data *audio = ev->audio;
+    float bpm = ev->bpm;
+    long int start = ev->start;
+    long int end = ev->end;
+    const slice_map *m = NULL;
+    if (ev->type == EV_SLICE_ON){
+      m = ctx->slice_maps[chan].load();
+      if (m == NULL){
+        return;
+      }
+      audio = m->audio;
+      bpm = m->bpm;
+      start = m->start[ev->slice];
+      end = ev->to_end ? audio->nframes : m->end[ev->slice];
+    }
+
+    if (ev->exclusive){
+      for (voice *v = ctx->chan_oldest[chan]; v != NULL; v = v->next){
+        voice_choke(v, CHOKE_SECONDS, ctx->rate);
+      }
+    }
+
+    // cut off voices of the same choke group
+    int group = ctx->choke_groups[chan];
+    for (int i = 0; (group >= 0) && (i < ctx->num_voices); i++){
+      voice *v = &ctx->voices[i];
+      if (v->active && (v->choke_group == group)){
+        voice_choke(v, CHOKE_SECONDS, ctx->rate);
+      }
+    }
+
+    // make room within the polyphony of the channel
+    if (ctx->chan_voice_count[chan] >= ctx->polyphony[chan].load(memory_order_relaxed)){
+      voice *victim = steal_victim(ctx, chan, ev->note);
+      if (victim != NULL){
+        voice_choke(victim, CHOKE_SECONDS, ctx->rate);
+      }
+    }
+
+    voice *v = take_voice(ctx);
+    v->channel = chan;
+    v->note = ev->note;
+    v->choke_group = group;
+    v->age = ctx->voice_age++;
+    link_voice(ctx, v);
+    adsr env = channel_env(ctx, chan);
+    voice_start(v, channel_voice_mode(ctx, chan, ev->transpose), audio, start, end,
+        ctx->velocity_gain[ev->velocity & 0x7f], &env, ctx->rate);
+    v->delay = ev->offset;
+    v->bpm = bpm;
+    v->interp = (interp_type)ctx->fx[chan].interp.load(memory_order_relaxed);
+    v->transpose = ev->transpose;
+    apply_fx(ctx, v);
+    if (v->mode == VOICE_STRETCH){
+      sample_data *head = slice_head(ctx, m, ev, v);
+      if (head != NULL){
+        voice_set_head(v, head);
+        ctx->primed_triggers++;
+      } else {
+        ctx->cold_triggers++;
+      }
+    }
+    if (ev->seq_step >= 0){
+      ctx->recorded_step[chan][ev->note] = ev->seq_step;
+    }
+    // the voice took over from the reference of the event
+    if (ev->type == EV_NOTE_ON){
+      sample_data_unref(ev->audio);
+    }
+    return;
+  }
+
+  // note off
+  voice *v = ctx->note_voices[chan][ev->note];
+  if ((v == NULL) || (v->env.stage == ENV_RELEASE)){
+    return;
+  }
+  // report slice end of what has been heard so far
+  if (ev->report_end){
+    voice_event report = *ev;
+    report.type = EV_SLICE_END;
+    report.end = max(v->start, voice_heard_pos(v) - ctx->latency);
+    push_event(&ctx->reports, &report);
+  }
+  voice_release(v);
+}
+
+// play a step of the sequencer
+static void play_trigger(ctx *ctx, const seq_trigger *tr)
+{
+  // played live already while it was recorded
+  int *recorded = &ctx->recorded_step[tr->channel][tr->note];
+  if (*recorded == tr->step){
+    *recorded = -1;
+    return;
+  }
+
+  voice_event ev;
+  ev.type = EV_SLICE_ON;
+  ev.channel = tr->channel;
+  ev.note = tr->note;
+  ev.velocity = tr->velocity;
+  ev.slice = tr->note;
+  ev.transpose = 0;
+  ev.audio = NULL;
+  ev.bpm = 0;
+  ev.to_end = false;
+  ev.report_end = false;
+  ev.exclusive = false;
+  ev.offset = tr->offset;
+  ev.seq_step = -1;
+  handle_event(ctx, &ev);
+}
+
+// time a midi realtime message 'frames' after the period being mixed is
+// heard. Writing to the sequencer is a syscall, the message is queued for
+// the midi thread to schedule. Output latency leaves it periods to do so
+static void send_clock(ctx *ctx, snd_seq_event_type_t type, double frames)
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  clock_msg msg;
+  msg.type = type;
+  msg.due = ts.tv_sec + ts.tv_nsec * 1e-9 + (ctx->latency + frames) / ctx->rate;
+  // a full queue drops the tick, as a full output pool would
+  push_clock(&ctx->clock_msgs, &msg);
+}
+
+// trigger the sequencer steps falling into the next period
+static void run_sequencer(ctx *ctx)
+{
+  bool running = ctx->seq_running.load();
+  bool send = (ctx->clock_mode.load() == CLOCK_SEND) && (ctx->seq_out != NULL);
+  if (ctx->seq_reset.exchange(false)){
+    seq_start(&ctx->seq);
+    ctx->clock_ticks = 0;
+    if (running && send){
+      send_clock(ctx, SND_SEQ_EVENT_START, 0);
+    }
+  }
+  if (!running && ctx->seq_was_running && send){
+    send_clock(ctx, SND_SEQ_EVENT_STOP, 0);
+  }
+  ctx->seq_was_running = running;
+  if (!running){
+    return;
   }
 
-  s->bpm = bpm.getBpm();
-  printf("Loaded on Ch:%d (%d bpm)\n",ctx->midi_chan, s->bpm);
-  ctx->samples[ctx->midi_chan] = *s;
+  const seq_pattern *patterns[MAX_SAMPLES];
+  for (int i = 0; i < MAX_SAMPLES; i++){
+    patterns[i] = ctx->patterns[i].load();
+  }
+  int n = seq_advance(&ctx->seq, patterns, MAX_SAMPLES, ctx->seq_bpm.load(),
+      ctx->seq_swing.load(), ctx->rate, PERIOD_FRAMES, ctx->triggers, MAX_TRIGGERS);
+  for (int i = 0; i < n; i++){
+    play_trigger(ctx, &ctx->triggers[i]);
+  }
 
-  // set sample tempo to 120
-  // int tempoDelta = (120 / s->bpm - 1.0f) * 100.0f;
-  // printf("TEMPO DELLIETA! %d -> %d\n", s->bpm , tempoDelta);
-  //ctx->soundTouch.setTempoChange(tempoDelta);
+  // clock ticks of the period, steps are 6 ticks
+  double pos = seq_position(&ctx->seq);
+  double start = pos - PERIOD_FRAMES / ctx->seq.frames_per_step;
+  while (send && ((double)ctx->clock_ticks / CLOCKS_PER_STEP < pos)){
+    double tick = (double)ctx->clock_ticks / CLOCKS_PER_STEP;
+    send_clock(ctx, SND_SEQ_EVENT_CLOCK, max(0.0, tick - start) * ctx->seq.frames_per_step);
+    ctx->clock_ticks++;
+  }
+  ctx->seq_pos.store(pos);
 }
 
+// Follow a clock tick from external gear. Tempo comes from the jitter
+// filtered tick period and is nudged to close the gap between the position
+// of the clock & the position heard from the sequencer
+static void followClock(ctx *ctx)
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  pll_tick(&ctx->pll, ts.tv_sec + ts.tv_nsec * 1e-9);
+  if (!pll_locked(&ctx->pll)){
+    return;
+  }
 
-static snd_pcm_t* initPCM(snd_pcm_stream_t stream){
+  double bpm = pll_bpm(&ctx->pll);
+  if (ctx->seq_running.load()){
+    double frames_per_step = ctx->rate * 60.0 / (bpm * SEQ_STEPS_PER_BEAT);
+    double heard = ctx->seq_pos.load() - ctx->latency / frames_per_step;
+    double ext = (double)(ctx->pll.ticks - 1) / CLOCKS_PER_STEP;
+    double correction = CLOCK_PHASE_GAIN * (ext - heard);
+    correction = max(-CLOCK_MAX_CORRECTION, min(CLOCK_MAX_CORRECTION, correction));
+    bpm *= 1.0 + correction;
+  }
+  ctx->seq_bpm = bpm;
+}
 
-  // pcm init
-  unsigned int pcm;
-  snd_pcm_hw_params_t *params;
-  snd_pcm_t *pcm_handle;
+// Record a pad hit to the nearest step of the pattern of its channel. The
+// hit is placed where it was heard, output latency behind the sequencer
+static void recordStep(ctx *ctx, voice_event *ev)
+{
+  seq_pattern *p = &ctx->edit_patterns[ev->channel];
+  double frames_per_step = ctx->rate * 60.0 / (ctx->seq_bpm.load() * SEQ_STEPS_PER_BEAT);
+  double pos = ctx->seq_pos.load();
+  long int nearest = lround(pos - ctx->latency / frames_per_step);
+  int step = ((nearest % p->length) + p->length) % p->length;
+
+  if (!seq_set_step(p, step, ev->note, ev->velocity)){
+    printf("No free lane on Ch:%d\n", ev->channel);
+    return;
+  }
+  publishPattern(ctx, ev->channel);
 
-	if (pcm = snd_pcm_open(&pcm_handle, PCM_DEVICE,
-				stream, 0) < 0)
-		printf("ERROR: Can't open \"%s\" PCM. %s\n",
-				stream, snd_strerror(pcm));
+  // the sequencer hasn't got to the step yet, it's played live instead
+  double swing = (nearest & 1) ? ctx->seq_swing.load() : 0;
+  if (nearest + swing > pos){
+    ev->seq_step = step;
+  }
+}
 
-  // aloc params with default values
-  snd_pcm_hw_params_alloca(&params);
-  snd_pcm_hw_params_any(pcm_handle, params);
+// move a smoothed value one period closer to its target
+// \return true if it moved
+static bool smooth_step(smoothed *s, float coef)
+{
+  float target = s->target.load(memory_order_relaxed);
+  if (s->value == target){
+    return false;
+  }
+  if (fabsf(target - s->value) < SMOOTH_EPSILON){
+    s->value = target;
+  } else {
+    s->value += (target - s->value) * coef;
+  }
+  return true;
+}
 
-  // override defaults
-  if (pcm = snd_pcm_hw_params_set_format(pcm_handle, params,
-        SND_PCM_FORMAT_FLOAT_LE) < 0)
-    printf("ERROR: Can't set format. %s\n", snd_strerror(pcm));
+// sets up the insert chains for the smoothed settings of their channels &
+// picks the channels that go through them. A chain set back to neutral runs
+// one more period, so its gains ramp home & the filter rings out
+static void update_chains(ctx *ctx)
+{
+  for (int c = 0; c < MAX_SAMPLES; c++){
+    fxctl *fx = &ctx->fx[c];
+    bool moved = smooth_step(&fx->cutoff, ctx->smooth_coef);
+    moved |= smooth_step(&fx->resonance, ctx->smooth_coef);
+    moved |= smooth_step(&fx->drive, ctx->smooth_coef);
+    moved |= smooth_step(&fx->gain, ctx->smooth_coef);
+    moved |= smooth_step(&fx->pan, ctx->smooth_coef);
+    int filter = fx->filter.load(memory_order_relaxed);
+
+    fx_settings s;
+    s.filter = (filter_type)filter;
+    s.cutoff = CUTOFF_MIN * powf(CUTOFF_RANGE, fx->cutoff.value);
+    s.resonance = Q_MIN * powf(Q_RANGE, fx->resonance.value);
+    s.drive = fx->drive.value;
+    s.gain = fx->gain.value;
+    s.pan = fx->pan.value;
+    if (moved || (filter != fx->applied_filter)){
+      fx_update(&ctx->chains[c], &s, ctx->rate);
+      fx->applied_filter = filter;
+    }
 
-  if (pcm =  snd_pcm_hw_params_set_access(pcm_handle, params,
-        SND_PCM_ACCESS_RW_INTERLEAVED) < 0)
-    printf("ERROR: Can't set access. %s\n", snd_strerror(pcm));
+    bool neutral = fx_neutral(&s);
+    ctx->fx_used[c] = !neutral || fx->active;
+    fx->active = !neutral;
+  }
+}
 
-  if (pcm = snd_pcm_hw_params_set_channels(pcm_handle, params, CHANNELS) < 0) 
-    printf("ERROR: Can't set channels number. %s\n", snd_strerror(pcm));
+// stereo mix of output bus 'bus'
+static inline SAMPLETYPE *bus_mix(ctx *ctx, int bus)
+{
+  return ctx->mix + bus * PERIOD_FRAMES * CHANNELS;
+}
 
-  unsigned int rate = RATE;
-  if (pcm = snd_pcm_hw_params_set_rate_near(pcm_handle, params, &rate, 0) < 0) 
-    printf("ERROR: Can't set rate. %s\n", snd_strerror(pcm));
+// Write silence to a device written without blocking, to half its buffer,
+// so its clock has room to drift either way
+static void prime_output(output *out)
+{
+  int frames = stream_max_output(&out->resampler, PERIOD_FRAMES);
+  memset(out->resampled, 0, frames * out->channels * sizeof(SAMPLETYPE));
+  snd_pcm_sframes_t avail = snd_pcm_avail(out->pcm);
+  long int missing = (avail < 0) ? 0 : avail - out->buffer / 2;
+  while (missing > 0){
+    snd_pcm_sframes_t err = snd_pcm_writei(out->pcm, out->resampled, min<long int>(frames, missing));
+    if (err <= 0){
+      break;
+    }
+    missing -= err;
+  }
+  out->primed = true;
+}
 
+// Write a period of the buses of an output. Only the first pcm blocks, the
+// others are skipped for the period when they have no room rather than hold
+// up the mix, & have the rate they are converted to steered by how full
+// they are
+static void write_output(ctx *ctx, output *out, bool pacing)
+{
+  const SAMPLETYPE *frames = bus_mix(ctx, out->first_bus);
+  if (out->channels > CHANNELS){
+    int pairs = out->channels / CHANNELS;
+    for (int p = 0; p < pairs; p++){
+      const SAMPLETYPE *mix = bus_mix(ctx, out->first_bus + p);
+      SAMPLETYPE *o = out->frames + p * CHANNELS;
+      for (int i = 0; i < PERIOD_FRAMES; i++){
+        o[i * out->channels] = mix[2*i];
+        o[i * out->channels + 1] = mix[2*i + 1];
+      }
+    }
+    frames = out->frames;
+  }
 
-  if (pcm = snd_pcm_hw_params_set_buffer_size(pcm_handle, params, BUFF_SIZE/2) < 0) 
-    printf("ERROR: Can't set buffersize. %s\n", snd_strerror(pcm));
+  int count = PERIOD_FRAMES;
+  if (out->resampling){
+    if (!pacing && !out->primed){
+      prime_output(out);
+    }
+    count = stream_process(&out->resampler, frames, PERIOD_FRAMES, out->resampled);
+    frames = out->resampled;
+  }
 
-  unsigned int period = 2; 
-  if (pcm = snd_pcm_hw_params_set_period_time_near(pcm_handle, params, &period, 0) < 0) 
-    printf("ERROR: Can't set period time. %s\n", snd_strerror(pcm));
+  snd_pcm_sframes_t err = snd_pcm_writei(out->pcm, frames, count);
+  if (err == -EAGAIN){
+    out->dropped++;
+  } else if (err < 0){
+    // recover from underrun, a device on its own clock starts over
+    out->xruns++;
+    if ((err = snd_pcm_recover(out->pcm, err, 0)) < 0){
+      fprintf(stderr, "write err %s %s\n", out->device.c_str(), snd_strerror(err));
+    }
+    if (!pacing){
+      stream_reset(&out->resampler);
+      out->primed = false;
+    }
+  } else if (!pacing && (err < count)){
+    out->dropped++;
+  }
 
-  /* Write parameters */
-  if (pcm = snd_pcm_hw_params(pcm_handle, params) < 0)
-    printf("ERROR: Can't set harware parameters. %s\n", snd_strerror(pcm));
+  if (!pacing && out->primed){
+    snd_pcm_sframes_t avail = snd_pcm_avail(out->pcm);
+    if (avail >= 0){
+      stream_track(&out->resampler, out->buffer - avail, out->buffer / 2);
+      out->drift_ppm.store(stream_drift_ppm(&out->resampler), memory_order_relaxed);
+    }
+  }
+}
 
-  snd_pcm_uframes_t   	buffer_size; 
-  snd_pcm_uframes_t   	period_size;
-  snd_pcm_get_params(pcm_handle, &buffer_size, &period_size);
-  printf("PCM OPENED WITH: %ld buffer, %ld period\n", buffer_size, period_size);
+// period of a voice, rendered before mixing down
+static inline SAMPLETYPE *voice_output(ctx *ctx, const voice *v)
+{
+  return ctx->voice_out + (v - ctx->voices) * PERIOD_FRAMES * CHANNELS;
+}
 
-	if ((pcm = snd_pcm_prepare (pcm_handle)) < 0) {
-	 	fprintf (stderr, "cannot prepare audio interface for use (%s)\n",
-	 					 snd_strerror (pcm));
-	 	exit (1);
-	}
+static inline int64_t monotonic_ns()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-  return pcm_handle;
+// Render a voice of the period, on the audio thread or a worker. Touches
+// the voice & its output only
+static void render_job(void *arg, int i)
+{
+  ctx *ctx = (struct ctx *)arg;
+  voice *v = ctx->render_list[i];
+  SAMPLETYPE *out = voice_output(ctx, v);
+  memset(out, 0, PERIOD_FRAMES * CHANNELS * sizeof(SAMPLETYPE));
+  voice_render(v, out, PERIOD_FRAMES);
 }
 
-// Sets the 'SoundTouch' object up according to input file sound format & 
-// command line parameters
-static void setup(SoundTouch *pSoundTouch, const RunParameters *params)
+// Mix down slice 'i' of the period of every voice rendered. Each frame is
+// summed in voice order, so the mix is the same for any number of threads
+static void mix_job(void *arg, int i)
 {
-  int sampleRate;
-  int channels;
+  ctx *ctx = (struct ctx *)arg;
+  int frames = PERIOD_FRAMES / ctx->mix_slices;
+  int offset = i * frames * CHANNELS;
+  int rendering = ctx->render_voices.load(memory_order_relaxed);
+  for (int k = 0; k < rendering; k++){
+    mix_ramp(ctx->render_dest[k] + offset, voice_output(ctx, ctx->render_list[k]) + offset,
+        frames, 1, 1);
+  }
+}
 
-  pSoundTouch->setSampleRate(RATE);
-  pSoundTouch->setChannels(CHANNELS);
+// Mix all voices one period at a time. Playback is paced by the
+// blocking write of the first pcm
+static void audio_thread(ctx *ctx)
+{
+  unsigned int fx_version = ctx->fx_version.load() - 1;
+  float session_bpm = 0;
+  voice_event ev;
+
+  rt_prefault_stack(AUDIO_STACK_PREFAULT);
+  rt_enter_audio_thread();
+#ifdef __SSE__
+  // insert filters ring out into denormals
+  _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+#endif
+
+  while (1) {
+    int64_t started = monotonic_ns();
+
+    // take events queued by the midi thread
+    while (pop_event(&ctx->events, &ev)){
+      handle_event(ctx, &ev);
+    }
+    run_sequencer(ctx);
+
+    // slice tables & patterns looked up so far are no longer referenced
+    ctx->audio_epoch++;
+
+    // modulation or session tempo changed, voices are set up once per
+    // period at most however fast the controllers move
+    bool moved = smooth_step(&ctx->tempo, ctx->smooth_coef);
+    moved |= smooth_step(&ctx->pitch, ctx->smooth_coef);
+    moved |= smooth_step(&ctx->rate_change, ctx->smooth_coef);
+    bool rematch = ctx->tempo_match.load() &&
+      (fabsf(ctx->seq_bpm.load() - session_bpm) > MATCH_MIN_BPM_CHANGE);
+    if ((ctx->fx_version.load() != fx_version) || moved || rematch){
+      fx_version = ctx->fx_version.load();
+      session_bpm = ctx->seq_bpm.load();
+      for (int i = 0; i < ctx->num_voices; i++){
+        if (ctx->voices[i].active){
+          apply_fx(ctx, &ctx->voices[i]);
+        }
+      }
+    }
 
-  pSoundTouch->setTempoChange(params->tempoDelta);
-  pSoundTouch->setPitchSemiTones(params->pitchDelta);
-  pSoundTouch->setRateChange(params->rateDelta);
+    // voices of channels with an insert chain render to the bus of their
+    // channel, the others straight to the mix of their output bus
+    update_chains(ctx);
+    for (int c = 0; c < MAX_SAMPLES; c++){
+      ctx->period_routes[c] = ctx->routes[c].load(memory_order_relaxed);
+    }
+    memset(ctx->mix, 0, ctx->num_buses * PERIOD_FRAMES * CHANNELS * sizeof(SAMPLETYPE));
+    for (int c = 0; c < MAX_SAMPLES; c++){
+      if (ctx->fx_used[c]){
+        memset(ctx->buses + c * PERIOD_FRAMES * CHANNELS, 0,
+            PERIOD_FRAMES * CHANNELS * sizeof(SAMPLETYPE));
+      }
+    }
+    int rendering = 0;
+    for (int i = 0; i < ctx->num_voices; i++){
+      if (ctx->voices[i].active){
+        ctx->render_list[rendering++] = &ctx->voices[i];
+      }
+    }
+    for (int i = 0; i < rendering; i++){
+      int chan = ctx->render_list[i]->channel;
+      ctx->render_dest[i] = ctx->fx_used[chan] ? ctx->buses + chan * PERIOD_FRAMES * CHANNELS :
+        bus_mix(ctx, ctx->period_routes[chan]);
+    }
+    ctx->render_voices.store(rendering, memory_order_relaxed);
+
+    // voices render & are then mixed down a slice of the period at a time,
+    // whichever thread rendered them
+    int64_t forked = monotonic_ns();
+    pool_run(&ctx->pool, render_job, ctx, rendering);
+    pool_run(&ctx->pool, mix_job, ctx, ctx->mix_slices);
+    int64_t joined = monotonic_ns();
+
+    for (int i = 0; i < rendering; i++){
+      voice *v = ctx->render_list[i];
+      if (v->warmup >= 0){
+        ctx->last_warmup = v->warmup;
+        if (v->warmup > ctx->worst_warmup.load(memory_order_relaxed)){
+          ctx->worst_warmup = v->warmup;
+        }
+        v->warmup = -1;
+      }
+      if (!v->active){
+        free_voice(ctx, v);
+      }
+    }
 
-  pSoundTouch->setSetting(SETTING_USE_QUICKSEEK, params->quick);
-  pSoundTouch->setSetting(SETTING_USE_AA_FILTER, !(params->noAntiAlias));
+    // chains run in pairs, side by side in the vector lanes, pairs mix to
+    // one output bus
+    for (int bus = 0; bus < ctx->num_buses; bus++){
+      int pending = -1;
+      for (int c = 0; c < MAX_SAMPLES; c++){
+        if (!ctx->fx_used[c] || (ctx->period_routes[c] != bus)){
+          continue;
+        }
+        if (pending < 0){
+          pending = c;
+          continue;
+        }
+        fx_process(&ctx->chains[pending], ctx->buses + pending * PERIOD_FRAMES * CHANNELS,
+            &ctx->chains[c], ctx->buses + c * PERIOD_FRAMES * CHANNELS,
+            bus_mix(ctx, bus), PERIOD_FRAMES);
+        pending = -1;
+      }
+      if (pending >= 0){
+        fx_process(&ctx->chains[pending], ctx->buses + pending * PERIOD_FRAMES * CHANNELS,
+            NULL, NULL, bus_mix(ctx, bus), PERIOD_FRAMES);
+      }
+    }
 
-  if (params->speech)
-  {
-    // use settings for speech processing
-    pSoundTouch->setSetting(SETTING_SEQUENCE_MS, 40);
-    pSoundTouch->setSetting(SETTING_SEEKWINDOW_MS, 15);
-    pSoundTouch->setSetting(SETTING_OVERLAP_MS, 8);
-    fprintf(stderr, "Tune processing parameters for speech processing.\n");
+    // write & conversion to the device rate are left out, the first write
+    // waits for the device
+    float serial = (float)((forked - started) + (monotonic_ns() - joined));
+    ctx->render_ns.store(ctx->render_ns.load(memory_order_relaxed) +
+        METRICS_SMOOTHING * ((float)(joined - forked) - ctx->render_ns.load(memory_order_relaxed)),
+        memory_order_relaxed);
+    ctx->serial_ns.store(ctx->serial_ns.load(memory_order_relaxed) +
+        METRICS_SMOOTHING * (serial - ctx->serial_ns.load(memory_order_relaxed)),
+        memory_order_relaxed);
+
+    for (int i = 0; i < ctx->num_outputs; i++){
+      write_output(ctx, &ctx->outputs[i], (i == 0));
+    }
   }
+}
 
-  fflush(stderr);
+// controller value to envelope time in seconds, finer at short times
+static float ctl_seconds(int value, int max, float max_seconds)
+{
+  float x = value / (float)max;
+  return x * x * max_seconds;
 }
 
-void openMidi(struct ctx *ctx)
+// controllers of the default map, 7-bit except for tempo & rate, whose fine
+// halves are free. Fine slice offsets & pitch are on NRPNs
+static void defaultControllers(controller_map *m)
 {
-  snd_seq_open(&ctx->seq_handle, "default", SND_SEQ_OPEN_INPUT, 0);
+  ctlmap_clear(m);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, MODE_CTL, ACT_MODE, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, SLICE_START_CTL, ACT_SLICE_START, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, SLICE_END_CTL, ACT_SLICE_END, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, SAVE_CTL, ACT_SAVE, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, TEMPO_CTL, ACT_TEMPO, true);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, PITCH_CTL, ACT_PITCH, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, RATE_CTL, ACT_RATE, true);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, ATTACK_CTL, ACT_ATTACK, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, DECAY_CTL, ACT_DECAY, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, SUSTAIN_CTL, ACT_SUSTAIN, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, RELEASE_CTL, ACT_RELEASE, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, POLY_CTL, ACT_POLY, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, STEAL_CTL, ACT_STEAL, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, SEQ_RUN_CTL, ACT_SEQ_RUN, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, SEQ_REC_CTL, ACT_SEQ_REC, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, SEQ_BPM_CTL, ACT_SEQ_BPM, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, SEQ_SWING_CTL, ACT_SEQ_SWING, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, SEQ_LENGTH_CTL, ACT_SEQ_LENGTH, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, SEQ_CLEAR_CTL, ACT_SEQ_CLEAR, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, CLOCK_CTL, ACT_CLOCK, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, MATCH_CTL, ACT_MATCH, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, BANK_CTL, ACT_BANK, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, BANK_NEXT_CTL, ACT_BANK_NEXT, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, BANK_PREV_CTL, ACT_BANK_PREV, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, ORDER_CTL, ACT_ORDER, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, BPM_MIN_CTL, ACT_BPM_MIN, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, BPM_MAX_CTL, ACT_BPM_MAX, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, SEEK_CTL, ACT_SEEK, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, FILTER_CTL, ACT_FILTER, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, CUTOFF_CTL, ACT_CUTOFF, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, RESONANCE_CTL, ACT_RESONANCE, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, DRIVE_CTL, ACT_DRIVE, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, GAIN_CTL, ACT_GAIN, true);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, PAN_CTL, ACT_PAN, true);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, PLAY_MODE_CTL, ACT_PLAY_MODE, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, INTERP_CTL, ACT_INTERP, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, CHROMATIC_CTL, ACT_CHROMATIC, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, METRICS_CTL, ACT_METRICS, false);
+  ctlmap_bind_cc(m, CTL_ANY_CHANNEL, OUTPUT_CTL, ACT_OUTPUT, false);
+  ctlmap_bind_nrpn(m, CTL_ANY_CHANNEL, SLICE_START_NRPN, ACT_SLICE_START);
+  ctlmap_bind_nrpn(m, CTL_ANY_CHANNEL, SLICE_END_NRPN, ACT_SLICE_END);
+  ctlmap_bind_nrpn(m, CTL_ANY_CHANNEL, PITCH_NRPN, ACT_PITCH);
+  ctlmap_bind_bend(m, CTL_ANY_CHANNEL, ACT_BEND);
+}
 
-  snd_seq_set_client_name(ctx->seq_handle, "Choppage");
-  int port = snd_seq_create_simple_port(ctx->seq_handle, "Choppage Input",
-      SND_SEQ_PORT_CAP_WRITE|SND_SEQ_PORT_CAP_SUBS_WRITE,
-      SND_SEQ_PORT_TYPE_APPLICATION);
+// move the start or end of the selected slice, 'nudge' in slice nudge steps
+static void nudgeSlice(ctx *ctx, bool end, float nudge)
+{
+  if ((ctx->selectedSample == NULL) || (ctx->selectedSample->selectedSlice == NULL)){
+    return;
+  }
+  slice *slc = ctx->selectedSample->selectedSlice;
+  long int offset = lroundf(nudge * SLICE_NUDGE_FRAMES);
+  if (end){
+    slc->end_offset = offset;
+  } else {
+    slc->start_offset = offset;
+  }
+  if (selectedChannel(ctx) >= 0){
+    publishSlices(ctx, selectedChannel(ctx));
+  }
 }
 
-static snd_pcm_t* pcm_handle(ctx *ctx) {
-	ctx->pcm_cursor = (ctx->pcm_cursor+1) % MAX_PCM_HANDLES;
-	return ctx->pcm_handles[ctx->pcm_cursor].pcm;
+// Switch to program 'prog' of the mode controller or a program change, others
+// are ignored
+static void selectProgram(ctx *ctx, int prog)
+{
+  if (prog == CHP_EDIT){
+    ctx->prog = CHP_EDIT;
+    loadSelectedSnippet(ctx);
+  }
+  if (prog == CHP_MPC){
+    ctx->prog = CHP_MPC;
+    // heads follow the modulation set since the slices were published
+    for (int chan = 0; chan < MAX_SAMPLES; chan++){
+      if (ctx->samples[chan].audio != NULL){
+        publishSlices(ctx, chan);
+      }
+    }
+  }
+  if (prog == CHP_BROWSE){
+    ctx->prog = CHP_BROWSE;
+    // TODO: unload selected sample
+  }
 }
 
-// pass in the interval 
-static void play_sample(ctx *ctx, slice *slc, unsigned char thread_id)
+// Trigger latency of stretched voices. SoundTouch holds back its initial
+// latency of input before the first output, heads hide it from triggers at
+// the settings they were made at. Mixing time is split into the voices
+// rendered & mixed down on the pool & the serial rest of the period
+static void printMetrics(ctx *ctx)
 {
+  int latency = ctx->head_latency.load();
+  printf("Stretch latency: %d frames (%.1f ms), hidden by heads of %d frames\n",
+      latency, latency * 1000.0f / ctx->rate, PRIME_HEAD_FRAMES);
+  printf("Stretched triggers: %u primed, %u cold, warm up last %.1f ms worst %.1f ms\n",
+      ctx->primed_triggers.load(), ctx->cold_triggers.load(),
+      ctx->last_warmup.load() * 1000.0f / ctx->rate,
+      ctx->worst_warmup.load() * 1000.0f / ctx->rate);
+  for (int i = 0; i < ctx->num_outputs; i++){
+    const output *out = &ctx->outputs[i];
+    printf("Output %s: %d channels at %u Hz, buses %d-%d, %u xruns, %u dropped",
+        out->device.c_str(), out->channels, out->rate, out->first_bus,
+        out->first_bus + out->channels / CHANNELS - 1, out->xruns.load(), out->dropped.load());
+    if (out->resampling){
+      printf(", converted from %u Hz drifting %+.1f ppm", ctx->rate, out->drift_ppm.load());
+    }
+    printf("\n");
+  }
+  // the serial part bounds how far more threads can speed up mixing
+  float period_ns = PERIOD_FRAMES * 1e9f / ctx->rate;
+  float render_ns = ctx->render_ns.load(), serial_ns = ctx->serial_ns.load();
+  printf("Period of %.0f us: %d voices rendered & mixed down in %.0f us on %d threads, "
+      "serial %.0f us (%.0f%% of the mixing)\n", period_ns / 1000, ctx->render_voices.load(),
+      render_ns / 1000, ctx->pool.threads, serial_ns / 1000,
+      100 * serial_ns / max(1.0f, render_ns + serial_ns));
+}
 
-  int err, nSamples;
-	long unsigned int start, end;
+// apply a decoded controller, 'value' is out of 'max'. Switches & steps use
+// the 7-bit value, continuous settings all bits
+static void applyControl(ctx *ctx, const ctl_value *c)
+{
+  int value = c->value * 128 / (c->max + 1);
+  float units = c->value * 128.0f / (c->max + 1);
+  bool fine = (c->max > 127);
+
+  switch (c->action){
+
+    // set prog mode
+    case ACT_MODE:
+      selectProgram(ctx, value);
+      break;
+
+    // slice editor
+    case ACT_SLICE_START:
+      nudgeSlice(ctx, false, units - 64);
+      break;
+    case ACT_SLICE_END:
+      nudgeSlice(ctx, true, units - 64);
+      break;
+    // write edited sample and its slices
+    case ACT_SAVE:
+      if (value >= 64){
+        saveSelectedSample(ctx);
+      }
+      break;
 
-	sample *s = ctx->selectedSample;
-  unsigned int nBuffers = s->buffers->size();
-  SAMPLETYPE *buff = new SAMPLETYPE[BUFF_SIZE];
+    // change tempo at same pitch
+    case ACT_TEMPO:
+      ctx->tempo.target = units - 64;
+      printf("Tempo: %.2f\n", units - 64);
+      break;
+
+    // change pitch at same tempo, in semitones unless fine
+    case ACT_PITCH:
+      ctx->pitch_ctl = fine ? units / 4 - 16 : value / 4 - 16;
+      ctx->pitch.target = ctx->pitch_ctl + ctx->bend;
+      printf("Pitch: %.2f\n", ctx->pitch_ctl);
+      break;
+    case ACT_BEND:
+      ctx->bend = (units - 64) / 64 * BEND_SEMITONES;
+      ctx->pitch.target = ctx->pitch_ctl + ctx->bend;
+      break;
+
+    // change both tempo and pitch
+    case ACT_RATE:
+      ctx->rate_change.target = units - 64;
+      printf("Rate: %.2f\n", units - 64);
+      break;
+
+    // envelope of current channel
+    case ACT_ATTACK:
+      ctx->envs[ctx->midi_chan].attack = ctl_seconds(c->value, c->max, 2.0f);
+      break;
+    case ACT_DECAY:
+      ctx->envs[ctx->midi_chan].decay = ctl_seconds(c->value, c->max, 2.0f);
+      break;
+    case ACT_SUSTAIN:
+      ctx->envs[ctx->midi_chan].sustain = c->value / (float)c->max;
+      break;
+    case ACT_RELEASE:
+      ctx->envs[ctx->midi_chan].release = ctl_seconds(c->value, c->max, 4.0f);
+      break;
+
+    // voices of current channel
+    case ACT_POLY:
+      ctx->polyphony[ctx->midi_chan] = max(1, min(ctx->num_voices, value));
+      printf("Polyphony: %d\n", ctx->polyphony[ctx->midi_chan].load());
+      break;
+    case ACT_STEAL:
+      ctx->steal[ctx->midi_chan] = min((int)STEAL_SAME_NOTE, value / 32);
+      break;
+
+    // sequencer
+    case ACT_SEQ_RUN:
+      ctx->seq_reset = (value >= 64) && !ctx->seq_running;
+      ctx->seq_running = (value >= 64);
+      printf("Sequencer %s at %.1f bpm\n", ctx->seq_running ? "running" : "stopped",
+          ctx->seq_bpm.load());
+      break;
+    case ACT_CLOCK:
+      ctx->clock_mode = min((int)CLOCK_SEND, value / 43);
+      pll_reset(&ctx->pll, CLOCK_BANDWIDTH);
+      printf("Clock: %s\n", (ctx->clock_mode == CLOCK_FOLLOW) ? "follow" :
+          ((ctx->clock_mode == CLOCK_SEND) ? "send" : "internal"));
+      break;
+    case ACT_MATCH:
+      ctx->tempo_match = (value >= 64);
+      ctx->fx_version++;
+      printf("Tempo match %s at %.1f bpm\n", ctx->tempo_match ? "on" : "off", ctx->seq_bpm.load());
+      break;
+    case ACT_SEQ_REC:
+      ctx->seq_record = (value >= 64);
+      break;
+    case ACT_SEQ_BPM:
+      // 0 follows the bpm of the sample loaded last
+      ctx->seq_bpm_auto = (c->value == 0);
+      if (ctx->seq_bpm_auto){
+        int bpm = ctx->samples[ctx->midi_chan].bpm;
+        if ((ctx->samples[ctx->midi_chan].audio != NULL) && (bpm > 0)){
+          ctx->seq_bpm = bpm;
+        }
+      } else {
+        ctx->seq_bpm = 60 + (fine ? units : value);
+      }
+      printf("BPM: %.1f\n", ctx->seq_bpm.load());
+      break;
+    case ACT_SEQ_SWING:
+      ctx->seq_swing = c->value / (2.0f * c->max);
+      break;
+    case ACT_SEQ_LENGTH:
+      ctx->edit_patterns[ctx->midi_chan].length = max(1, min(SEQ_MAX_STEPS, value));
+      publishPattern(ctx, ctx->midi_chan);
+      break;
+    case ACT_SEQ_CLEAR:
+      if (value >= 64){
+        seq_pattern *p = &ctx->edit_patterns[ctx->midi_chan];
+        seq_clear(p, ctx->midi_chan, p->length);
+        publishPattern(ctx, ctx->midi_chan);
+      }
+      break;
+
+    // browse catalogue, 14-bit bank numbers reach beyond 128 banks
+    case ACT_BANK:
+      selectBank(ctx, fine ? c->value : value);
+      break;
+    case ACT_BANK_NEXT:
+      if (value >= 64){
+        selectBank(ctx, ctx->bank + 1);
+      }
+      break;
+    case ACT_BANK_PREV:
+      if (value >= 64){
+        selectBank(ctx, ctx->bank - 1);
+      }
+      break;
+    // jump to a position in the catalogue, e.g. a letter when in name order
+    case ACT_SEEK:
+      selectBank(ctx, (int)(c->value / (float)c->max * ctx->catalogue.size()) / BANK_KEYS);
+      break;
+    case ACT_ORDER:
+      ctx->order = (catalogue_order)min((int)ORDER_DURATION, value / 43);
+      buildCatalogue(ctx);
+      selectBank(ctx, 0);
+      break;
+    // 0 removes the limit, others are bpm like the sequencer tempo
+    case ACT_BPM_MIN:
+    case ACT_BPM_MAX: {
+      float bpm = (c->value == 0) ? 0 : 60 + (fine ? units : value);
+      if (c->action == ACT_BPM_MIN){
+        ctx->bpm_min = bpm;
+      } else {
+        ctx->bpm_max = bpm;
+      }
+      buildCatalogue(ctx);
+      selectBank(ctx, 0);
+      printf("Catalogue: %zu samples at %.0f-%.0f bpm\n", ctx->catalogue.size(),
+          ctx->bpm_min, ctx->bpm_max);
+      break;
+    }
 
-	if (slc == NULL){
-		start = 0;
-		end = nBuffers;
-	} else {
-		start = slc->start + slc->start_offset;
-		if (ctx->prog == CHP_EDIT){
-			// play to end in edit mode because this can be changed
-			end = nBuffers;
-		}
-		if (ctx->prog == CHP_MPC){
-			end = slc->end + slc->end_offset;
-		}
-	}
+    // insert chain of the channel, off/lowpass/highpass/bandpass by quarters
+    case ACT_FILTER:
+      ctx->fx[ctx->midi_chan].filter = value / 32;
+      break;
+    case ACT_CUTOFF:
+      ctx->fx[ctx->midi_chan].cutoff.target = c->value / (float)c->max;
+      break;
+    case ACT_RESONANCE:
+      ctx->fx[ctx->midi_chan].resonance.target = c->value / (float)c->max;
+      break;
+    case ACT_DRIVE:
+      ctx->fx[ctx->midi_chan].drive.target = c->value / (float)c->max;
+      break;
+    // up to +6dB, unity a little past 3/4 of the way like a mixer fader
+    case ACT_GAIN: {
+      float x = c->value / (float)c->max;
+      float gain = 2 * x * x;
+      ctx->fx[ctx->midi_chan].gain.target = (fabsf(gain - 1) < GAIN_DETENT) ? 1.0f : gain;
+      break;
+    }
+    case ACT_PAN:
+      ctx->fx[ctx->midi_chan].pan.target = min(1.0f, max(-1.0f, (units - 64) / 63));
+      break;
+
+    // play mode of the channel from the next note on, values from the mode up
+    // select it
+    case ACT_PLAY_MODE: {
+      fx_mode mode = (value >= ST_MACHINE) ? ST_MACHINE :
+        (value >= ST_PASSTHROUGH) ? ST_PASSTHROUGH : ST_STRETCH;
+      ctx->fx[ctx->midi_chan].mode = mode;
+      printf("Ch:%d plays %s\n", ctx->midi_chan, (mode == ST_MACHINE) ? "varispeed" :
+          (mode == ST_PASSTHROUGH) ? "as recorded" : "stretched");
+      break;
+    }
 
-	snd_pcm_t *pcm = pcm_handle(ctx);
-  snd_pcm_prepare(pcm);
-
-  for (long unsigned int i=start; i<end; i++){
-    unsigned char diff = tid[ctx->midi_chan].load() - thread_id;
-    printf("DIFF %d\n", diff);
-    if (diff != 0) {
-      // stopping
-     	snd_pcm_drop(pcm);
-  		snd_pcm_prepare(pcm);
-			// update slice end
-			if ((slc != NULL) && (ctx->prog == CHP_EDIT)) {
-				slc->end = i-3;
-			}
-      return;  
+    // varispeed interpolation of the channel: linear, cubic or sinc by thirds
+    case ACT_INTERP: {
+      static const char * const names[] = {"linear", "cubic", "sinc"};
+      int interp = min((int)INTERP_SINC, value / 43);
+      ctx->fx[ctx->midi_chan].interp = interp;
+      printf("Ch:%d interpolation %s\n", ctx->midi_chan, names[interp]);
+      break;
     }
 
-    nSamples = BUFF_SIZE/CHANNELS;
-    memcpy(buff, s->buffers->at(i), BUFF_SIZE*4);
+    // output bus of the channel is the controller value, the last bus above it
+    case ACT_OUTPUT: {
+      int bus = min(ctx->num_buses - 1, value);
+      ctx->routes[ctx->midi_chan] = bus;
+      printf("Ch:%d output bus %d\n", ctx->midi_chan, bus);
+      break;
+    }
 
-    // Feed the samples into SoundTouch processor
-    ctx->soundTouch.putSamples(buff, nSamples);
-    nSamples = ctx->soundTouch.receiveSamples(buff, nSamples);
+    case ACT_METRICS:
+      if (value >= 64){
+        printMetrics(ctx);
+      }
+      break;
 
-    // output
-   if ((err = snd_pcm_writei(pcm, buff, nSamples)) < 0){
-     printf("write err %s\n", snd_strerror(err));
-   }
+    // keys of the channel play its selected slice transposed, around middle C
+    case ACT_CHROMATIC:
+      ctx->chromatic[ctx->midi_chan] = (value >= 64);
+      printf("Ch:%d chromatic %s\n", ctx->midi_chan, ctx->chromatic[ctx->midi_chan] ? "on" : "off");
+      break;
   }
 }
 
-// Play just a slice of sample
-static void play_slice(ctx *ctx, int note, unsigned char thread_id)
-{
-
-  int pcm, nSamples;
-	sample *s = ctx->selectedSample;
-  unsigned int nBuffers = s->buffers->size();
-  SAMPLETYPE *buff = new SAMPLETYPE[BUFF_SIZE];
-	
-  // get slice associated with note
-	slice *slc = &ctx->selectedSample->slices[note];
-	// if slice interval is not set then start at
-	// end of closest note with lower interval
-	long unsigned int startPos = slc->start;
-	if ((startPos == 0) && (note > s->low_key)) {
-		for (int i = note; i > 0; i--){
-			startPos = ctx->selectedSample->slices[i].end;
-			if (startPos > 0){
-				slc->start = startPos;
-				break;
-			}
-		}
-	}
-
-	// setting as low key since no previous key has interval
-	if ((startPos == 0) && (s->low_key == 0)) {
-		s->low_key = note;
-	}
 
-	s->selectedSlice = slc;
-	play_sample(ctx, slc, thread_id);
+// Schedule the clock messages timed by the audio thread on the sequencer
+// queue, at what is left of their delay
+static void sendClock(ctx *ctx)
+{
+  clock_msg msg;
+  bool sent = false;
+  while (pop_clock(&ctx->clock_msgs, &msg)){
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double delay = max(0.0, msg.due - (ts.tv_sec + ts.tv_nsec * 1e-9));
+    snd_seq_real_time_t t;
+    t.tv_sec = (unsigned int)delay;
+    t.tv_nsec = (unsigned int)((delay - t.tv_sec) * 1e9);
+
+    snd_seq_event_t ev;
+    snd_seq_ev_clear(&ev);
+    ev.type = msg.type;
+    snd_seq_ev_set_source(&ev, ctx->clock_port);
+    snd_seq_ev_set_subs(&ev);
+    snd_seq_ev_schedule_real(&ev, ctx->clock_queue, 1, &t);
+    snd_seq_event_output(ctx->seq_out, &ev);
+    sent = true;
+  }
+  if (sent){
+    snd_seq_drain_output(ctx->seq_out);
+  }
 }
 
+// Wait for midi input, taking heads finished meanwhile. While clock is sent,
+// wakes every period to pass the clock messages of the audio thread on
+// \return true if an event can be read without blocking
+static bool waitMidi(ctx *ctx)
+{
+  takeHeads(ctx);
+  bool clock = (ctx->seq_out != NULL);
+  if (clock){
+    sendClock(ctx);
+  }
+  if (snd_seq_event_input_pending(ctx->seq_handle, 0) > 0){
+    return true;
+  }
+  int timeout = (clock && (ctx->clock_mode.load() == CLOCK_SEND)) ?
+    max(1, (int)(PERIOD_FRAMES * 1000 / ctx->rate)) : -1;
+  if (poll(ctx->midi_fds, ctx->num_midi_fds + 1, timeout) <= 0){
+    return false;
+  }
+  for (int i = 0; i < ctx->num_midi_fds; i++){
+    if (ctx->midi_fds[i].revents != 0){
+      return true;
+    }
+  }
+  return false;
+}
 
 snd_seq_event_t *readMidi(struct ctx *ctx)
 {
@@ -424,6 +2998,15 @@ snd_seq_event_t *readMidi(struct ctx *ctx)
 		return NULL;
   }
 
+  // take slice ends heard since the last event
+  voice_event report;
+  while (pop_event(&ctx->reports, &report)){
+    ctx->samples[report.channel].slices[report.note].end = report.end;
+    publishSlices(ctx, report.channel);
+  }
+  takeSnippets(ctx);
+  reclaimRetired(ctx);
+
   if ((ev->type == SND_SEQ_EVENT_NOTEON)||(ev->type == SND_SEQ_EVENT_NOTEOFF)) {
     const char *type = (ev->type == SND_SEQ_EVENT_NOTEON) ? "on " : "off";
     printf("[%d] Note %s: %2x vel(%2x)\n", ev->data.note.channel, type,
@@ -431,125 +3014,137 @@ snd_seq_event_t *readMidi(struct ctx *ctx)
         ev->data.note.velocity);
     ctx->midi_chan = ev->data.note.channel;
 
+    voice_event vev;
+    vev.channel = ctx->midi_chan;
+    vev.note = ev->data.note.note;
+    vev.velocity = ev->data.note.velocity;
+    vev.slice = vev.note;
+    vev.transpose = 0;
+    vev.audio = NULL;
+    vev.bpm = 0;
+    vev.to_end = false;
+    vev.report_end = false;
+    vev.offset = 0;
+    vev.seq_step = -1;
+    // only pads play polyphonic, previews & slice editing cut off the last note
+    vev.exclusive = (ctx->prog != CHP_MPC);
+
     if ((ev->type == SND_SEQ_EVENT_NOTEON) && (ev->data.note.velocity > 0)){
-	
-			// update thread id
-			// this will also stop other running samples
-      tid[ctx->midi_chan].store(tid[ctx->midi_chan].load()+1);
-      ctx->soundTouch.clear();
+      vev.type = EV_NOTE_ON;
 
 			// play sample based on program
 			if (ctx->prog == CHP_BROWSE){
-
-			  // no matter how many notes we have
-				// sample will be spread across them all
-				int index = ev->data.note.note % ctx->snippets.size();
+				// key of the current bank
+        sample *snippet = bankSnippet(ctx, ev->data.note.note);
+        if (snippet == NULL){
+          return NULL;
+        }
   			// update selected sample 
-  			ctx->selectedSample = ctx->snippets.at(index);
-				thread t1(play_sample, ctx, nullptr, tid[ctx->midi_chan].load());
-				t1.detach();
+  			ctx->selectedSample = snippet;
+        vev.audio = ctx->selectedSample->audio;
+        sample_data_ref(vev.audio);
+        // pages of the pack are read in here, not by the audio thread
+        rt_prefault(vev.audio->frames, vev.audio->nframes * vev.audio->channels * sizeof(SAMPLETYPE));
+        vev.start = 0;
+        vev.end = vev.audio->nframes;
+        vev.bpm = ctx->selectedSample->bpm;
 			}
 			if ((ctx->prog == CHP_EDIT) || (ctx->prog == CHP_MPC)){
   			// update selected for channel 
   			ctx->selectedSample = &ctx->samples[ctx->midi_chan];
         // do not try and unloaded sample
-        if (ctx->selectedSample->buffers == NULL){
+        if (ctx->selectedSample->audio == NULL){
           printf("No slices on channel %d\n", ctx->midi_chan);
           return NULL;
         }
 
-				// play slice
-				int note = ev->data.note.note;
-				thread t1(play_slice, ctx, note, tid[ctx->midi_chan].load());
-				t1.detach();
+        // pads of a chromatic channel all play its selected slice, pitched
+        // by key
+        sample *s = ctx->selectedSample;
+        bool chromatic = (ctx->prog == CHP_MPC) && ctx->chromatic[ctx->midi_chan] &&
+          (s->selectedSlice != NULL);
+        if (chromatic){
+          vev.slice = (int)(s->selectedSlice - s->slices);
+          vev.transpose = (float)(vev.note - CHROMATIC_ROOT);
+        } else if (vev.note >= MAX_SLICES){
+          return NULL;
+        } else {
+          // play slice, the audio thread looks up its region.
+          // play to end in edit mode because this can be changed
+          selectSlice(ctx, ctx->midi_chan, vev.note);
+        }
+        vev.type = EV_SLICE_ON;
+        vev.to_end = (ctx->prog == CHP_EDIT);
+
+        // patterns hold slices, transposed hits aren't recorded
+        if ((ctx->prog == CHP_MPC) && ctx->seq_record && ctx->seq_running.load() &&
+            !chromatic){
+          recordStep(ctx, &vev);
+        }
 			}
+      if (!push_event(&ctx->events, &vev)){
+        printf("Event queue full, dropping event\n");
+        sample_data_release(&ctx->retired_audio, vev.audio);
+      }
     } else {
       // stop sample on key up when not in mpc mode
 			if (ctx->prog != CHP_MPC){
-      	tid[ctx->midi_chan].store(tid[ctx->midi_chan].load()+1);
+        vev.type = EV_NOTE_OFF;
+        // slice end follows note off in edit mode
+        vev.report_end = ((ctx->prog == CHP_EDIT) && (vev.note < MAX_SLICES));
+        if (!push_event(&ctx->events, &vev)){
+          printf("Event queue full, dropping event\n");
+        }
 			}
     }
   } else if (ev->type == SND_SEQ_EVENT_PGMCHANGE) {
     printf("Program Change:  %2x \n", ev->data.control.value);
-		if (ev->data.control.value == CHP_EDIT){
-			ctx->prog = CHP_EDIT;
-			loadSelectedSnippet(ctx);
-		}
-		if (ev->data.control.value == CHP_MPC){
-			ctx->prog = CHP_MPC;
-		}
-		if (ev->data.control.value == CHP_BROWSE){
-			ctx->prog = CHP_BROWSE;
-			// TODO: unload selected sample
-		}
+    selectProgram(ctx, ev->data.control.value);
   } else if(ev->type == SND_SEQ_EVENT_CONTROLLER) {
     printf("Control:  %2x val(%2x)\n", ev->data.control.param,
         ev->data.control.value);
-
-
-		// set prog mode
-    if(ev->data.control.param == MODE_CTL){
-			if (ev->data.control.value == CHP_EDIT){
-				ctx->prog = CHP_EDIT;
-				loadSelectedSnippet(ctx);
-			}
-			if (ev->data.control.value == CHP_MPC){
-				ctx->prog = CHP_MPC;
-			}
-			if (ev->data.control.value == CHP_BROWSE){
-				ctx->prog = CHP_BROWSE;
-				// TODO: unload selected sample
-			}
+    ctl_value c;
+    if (ctlmap_control(&ctx->ctl, ev->data.control.channel, ev->data.control.param,
+          ev->data.control.value, &c)){
+      applyControl(ctx, &c);
     }
-
-		// start slice editor
-		if (ev->data.control.param == SLICE_START_CTL){
-			if (ctx->selectedSample != NULL){
-				if (ctx->selectedSample->selectedSlice != NULL){
-					ctx->selectedSample->selectedSlice->start_offset = ev->data.control.value - 64;
-				}
-			}
-		}
-		// end slice editor
-		if (ev->data.control.param == SLICE_END_CTL){
-			if (ctx->selectedSample != NULL){
-				if (ctx->selectedSample->selectedSlice != NULL){
-					ctx->selectedSample->selectedSlice->end_offset = ev->data.control.value - 64;
-				}
-			}
-		}
-
-		// adjust fx
-
-    // change tempo at same pitch
-    if(ev->data.control.param == TEMPO_CTL){
-      int tempo = ev->data.control.value - 64;
-      printf("Tempo: %d\n", tempo);
-      ctx->soundTouch.setTempoChange(tempo);
+  } else if (ev->type == SND_SEQ_EVENT_CONTROL14) {
+    ctl_value c;
+    if (ctlmap_control14(&ctx->ctl, ev->data.control.channel, ev->data.control.param,
+          ev->data.control.value, &c)){
+      applyControl(ctx, &c);
     }
-
-    // change pitch	at same tempo 
-    if(ev->data.control.param == PITCH_CTL){
-      int pitch = ev->data.control.value/4 - 16;
-      printf("Pitch: %d\n", pitch);
-      ctx->soundTouch.setPitchSemiTones(pitch);
+  } else if (ev->type == SND_SEQ_EVENT_NONREGPARAM) {
+    ctl_value c;
+    if (ctlmap_nrpn(&ctx->ctl, ev->data.control.channel, ev->data.control.param,
+          ev->data.control.value, &c)){
+      applyControl(ctx, &c);
     }
-
-		// change both tempo and pitch
-    if(ev->data.control.param == RATE_CTL){
-      int rate = ev->data.control.value - 64;
-      ctx->soundTouch.setRateChange(rate);
-      printf("Rate: %d\n", rate);
+  } else if ((ev->type == SND_SEQ_EVENT_CLOCK) || (ev->type == SND_SEQ_EVENT_START) ||
+      (ev->type == SND_SEQ_EVENT_CONTINUE) || (ev->type == SND_SEQ_EVENT_STOP)){
+    // transport of external gear, when following
+    if (ctx->clock_mode.load() != CLOCK_FOLLOW){
+      return ev;
+    }
+    if (ev->type == SND_SEQ_EVENT_CLOCK){
+      followClock(ctx);
+    } else if (ev->type == SND_SEQ_EVENT_START){
+      pll_reset(&ctx->pll, CLOCK_BANDWIDTH);
+      ctx->seq_pos = 0;
+      ctx->seq_reset = true;
+      ctx->seq_running = true;
+    } else {
+      ctx->seq_running = (ev->type == SND_SEQ_EVENT_CONTINUE);
     }
-
-
-
   } else if (ev->type == SND_SEQ_EVENT_PORT_SUBSCRIBED){
     printf("Connected to midi controller\n");
   } else if (ev->type == SND_SEQ_EVENT_SENSING){
     // ignore
   } else if (ev->type == SND_SEQ_EVENT_PITCHBEND) {
-    printf("Pitch Bend %d\n", ev->data.control.value);
+    ctl_value c;
+    if (ctlmap_bend(&ctx->ctl, ev->data.control.channel, ev->data.control.value, &c)){
+      applyControl(ctx, &c);
+    }
   } else if (ev != NULL) {
     printf("[%d] Unknown:  Unhandled Event Received %d\n", ev->time.tick, ev->type);
 	} else {
@@ -561,66 +3156,23 @@ snd_seq_event_t *readMidi(struct ctx *ctx)
 
 
 
-// Detect BPM rate of inFile and adjust tempo setting accordingly if necessary
-static void detectBPM(WavInFile *inFile, RunParameters *params)
-{
-  float bpmValue;
-  int nChannels;
-  BPMDetect bpm(inFile->getNumChannels(), inFile->getSampleRate());
-  SAMPLETYPE sampleBuffer[BUFF_SIZE];
-
-  // detect bpm rate
-  fprintf(stderr, "Detecting BPM rate...");
-  fflush(stderr);
-
-  nChannels = (int)inFile->getNumChannels();
-
-  // Process the 'inFile' in small blocks, repeat until whole file has 
-  // been processed
-  while (inFile->eof() == 0)
-  {
-    int num, samples;
-
-    // Read sample data from input file
-    num = inFile->read(sampleBuffer, BUFF_SIZE);
-
-    // Enter the new samples to the bpm analyzer class
-    samples = num / nChannels;
-    bpm.inputSamples(sampleBuffer, samples);
-  }
-
-  // Now the whole song data has been analyzed. Read the resulting bpm.
-  bpmValue = bpm.getBpm();
-  fprintf(stderr, "Done!\n");
-
-  // rewind the file after bpm detection
-  inFile->rewind();
-
-  if (bpmValue > 0)
-  {
-    fprintf(stderr, "Detected BPM rate %.1f\n\n", bpmValue);
-  }
-  else
-  {
-    fprintf(stderr, "Couldn't detect BPM rate.\n\n");
-    return;
-  }
-
-  if (params->goalBPM > 0)
-  {
-    // adjust tempo to given bpm
-    params->tempoDelta = (params->goalBPM / bpmValue - 1.0f) * 100.0f;
-    fprintf(stderr, "The file will be converted to %.1f BPM\n\n", params->goalBPM);
-  }
-}
-
-
 int main(const int nParams, const char * const paramStr[])
 {
-  WavInFile *inFile;
   RunParameters *params;
   struct ctx ctx;
   ctx.prog = CHP_BROWSE;
+  ctx.selectedSample = NULL;
+  for (int i = 0; i < MAX_SAMPLES; i++){
+    ctx.samples[i].audio = NULL;
+    ctx.samples[i].file = NULL;
+    ctx.samples[i].owns_file = false;
+    ctx.samples[i].bpm = 0;
+    ctx.samples[i].loaded = false;
+    ctx.slice_maps[i] = NULL;
+    ctx.slice_versions[i] = 0;
+    ctx.head_jobs[i] = NULL;
+  }
+  ctx.audio_epoch = 0;
 
   fprintf(stderr, _helloText, SoundTouch::getVersionString());
 
@@ -629,33 +3181,209 @@ int main(const int nParams, const char * const paramStr[])
     // Parse command line parameters
     params = new RunParameters(nParams, paramStr);
 
-		// Open pcm handles 
-		for (int i = 0; i < MAX_PCM_HANDLES; i++){
-			ctx.pcm_handles[i].pcm = initPCM(SND_PCM_STREAM_PLAYBACK);
-		 if (ctx.pcm_handles[i].pcm == 0)
-			 return -1;
-		}
-		ctx.pcm_cursor = 0;
+		// Open pcm outputs
+    if (!openOutputs(&ctx, params)){
+      return -1;
+    }
 
 
 		// open Midi port
     openMidi(&ctx);
 
-    // Open input samples
-    if (openFiles(&inFile, &ctx, params) != 0)
+    // controller bindings
+    defaultControllers(&ctx.ctl);
+    if (!params->controllerMap.empty()){
+      ctlmap_load(&ctx.ctl, params->controllerMap.c_str(), ctl_names, NUM_ACTIONS);
+    }
+
+    // Open the sample library
+    if (openFiles(&ctx, params) != 0)
+      return -1;
+
+    // everything the audio thread touches comes from one prefaulted block
+    size_t output_bytes = 0;
+    for (int i = 0; i < ctx.num_outputs; i++){
+      if (ctx.outputs[i].resampling){
+        output_bytes += stream_max_output(&ctx.outputs[i].resampler, PERIOD_FRAMES) *
+          ctx.outputs[i].channels * sizeof(SAMPLETYPE) + 64;
+      }
+    }
+    ctx.num_voices = min(MAX_VOICES, VOICES_PER_THREAD * params->threads);
+    if (!rt_arena_init(&ctx.arena, ctx.num_voices * sizeof(voice) + output_bytes +
+          ctx.num_voices * PERIOD_FRAMES * CHANNELS * sizeof(SAMPLETYPE) +
+          (MAX_SAMPLES + 2 * MAX_BUSES) * PERIOD_FRAMES * CHANNELS * sizeof(SAMPLETYPE) +
+          MAX_SAMPLES * sizeof(fx_chain) +
+          MAX_TRIGGERS * sizeof(seq_trigger) + (MAX_OUTPUTS + 1) * 4096)){
+      fprintf(stderr, "Could not allocate voices\n");
       return -1;
+    }
+    ctx.voices = (voice *)rt_arena_alloc(&ctx.arena, ctx.num_voices * sizeof(voice), 64);
+    ctx.voice_out = (SAMPLETYPE *)rt_arena_alloc(&ctx.arena,
+        ctx.num_voices * PERIOD_FRAMES * CHANNELS * sizeof(SAMPLETYPE), 64);
+    ctx.mix = (SAMPLETYPE *)rt_arena_alloc(&ctx.arena,
+        ctx.num_buses * PERIOD_FRAMES * CHANNELS * sizeof(SAMPLETYPE), 64);
+    for (int i = 0; i < ctx.num_outputs; i++){
+      output *out = &ctx.outputs[i];
+      if (out->channels > CHANNELS){
+        out->frames = (SAMPLETYPE *)rt_arena_alloc(&ctx.arena,
+            PERIOD_FRAMES * out->channels * sizeof(SAMPLETYPE), 64);
+      }
+      if (out->resampling){
+        out->resampled = (SAMPLETYPE *)rt_arena_alloc(&ctx.arena,
+            stream_max_output(&out->resampler, PERIOD_FRAMES) * out->channels *
+            sizeof(SAMPLETYPE), 64);
+      }
+    }
+    ctx.triggers = (seq_trigger *)rt_arena_alloc(&ctx.arena,
+        MAX_TRIGGERS * sizeof(seq_trigger), 64);
+    ctx.buses = (SAMPLETYPE *)rt_arena_alloc(&ctx.arena,
+        MAX_SAMPLES * PERIOD_FRAMES * CHANNELS * sizeof(SAMPLETYPE), 64);
+    ctx.chains = (fx_chain *)rt_arena_alloc(&ctx.arena,
+        MAX_SAMPLES * sizeof(fx_chain), 64);
+
+    varispeed_init();
+    setup(&ctx.primer, ctx.rate, params);
+    ctx.head_latency = ctx.primer.getSetting(SETTING_INITIAL_LATENCY);
+    ctx.primed_triggers = 0;
+    ctx.cold_triggers = 0;
+    ctx.last_warmup = 0;
+    ctx.worst_warmup = 0;
+    ctx.render_voices = 0;
+    ctx.render_ns = 0;
+    ctx.serial_ns = 0;
+
+    // Setup the 'SoundTouch' object of every voice for processing the sound,
+    // its buffers are grown at the extremes of the fx controllers up front
+    for (int i = 0; i < ctx.num_voices; i++){
+      voice *v = new (&ctx.voices[i]) voice();
+      v->active = false;
+      v->mode = VOICE_STRETCH;
+      v->audio = NULL;
+      v->head = NULL;
+      v->warmup = -1;
+      setup(&v->st, ctx.rate, params);
+      voice_prewarm(v, -64, -16, -64);
+      voice_prewarm(v, 63, 15, 63);
+      ctx.free_voices[i] = &ctx.voices[ctx.num_voices - 1 - i];
+    }
+    ctx.num_free_voices = ctx.num_voices;
+    memset(ctx.note_voices, 0, sizeof(ctx.note_voices));
+    ctx.voice_age = 0;
+    ctx.tempo.value = ctx.tempo.target = params->tempoDelta;
+    ctx.pitch.value = ctx.pitch.target = params->pitchDelta;
+    ctx.pitch_ctl = params->pitchDelta;
+    ctx.bend = 0;
+    ctx.rate_change.value = ctx.rate_change.target = params->rateDelta;
+    float periods = params->smoothMs / 1000.0f * ctx.rate / PERIOD_FRAMES;
+    ctx.smooth_coef = (periods > 0) ? 1.0f - expf(-1.0f / periods) : 1.0f;
+    ctx.fx_version = 0;
+    ctx.events.head = 0;
+    ctx.events.tail = 0;
+    ctx.reports.head = 0;
+    ctx.reports.tail = 0;
+    ctx.clock_msgs.head = 0;
+    ctx.clock_msgs.tail = 0;
+    ctx.finished_heads.head = 0;
+    ctx.finished_heads.tail = 0;
+
+    for (int i = 0; i < MAX_SAMPLES; i++){
+      ctx.envs[i].attack = 0.002f;
+      ctx.envs[i].decay = 0;
+      ctx.envs[i].sustain = 1.0f;
+      ctx.envs[i].release = 0.01f;
+      ctx.choke_groups[i] = -1;
+      ctx.polyphony[i] = min(ctx.num_voices, params->polyphony);
+      ctx.steal[i] = STEAL_OLDEST;
+      ctx.chan_oldest[i] = NULL;
+      ctx.chan_newest[i] = NULL;
+      ctx.chan_voice_count[i] = 0;
+      seq_clear(&ctx.edit_patterns[i], i, SEQ_DEFAULT_STEPS);
+      ctx.patterns[i] = NULL;
+
+      fxctl *fx = &ctx.fx[i];
+      fx->mode = ST_STRETCH;
+      fx->interp = INTERP_CUBIC;
+      ctx.chromatic[i] = false;
+      fx->pitch = 0;
+      fx->rate = 0;
+      fx->filter = FILTER_OFF;
+      fx->applied_filter = FILTER_OFF;
+      fx->cutoff.value = fx->cutoff.target = 1.0f;
+      fx->resonance.value = fx->resonance.target = RESONANCE_DEFAULT;
+      fx->drive.value = fx->drive.target = 0;
+      fx->gain.value = fx->gain.target = 1.0f;
+      fx->pan.value = fx->pan.target = 0;
+      fx->active = false;
+      fx_reset(&ctx.chains[i]);
+      ctx.fx_used[i] = false;
+    }
+    ctx.order = ORDER_NAME;
+    ctx.bpm_min = 0;
+    ctx.bpm_max = 0;
+    ctx.bank = 0;
+    ctx.seq_running = false;
+    ctx.seq_reset = false;
+    ctx.clock_mode = params->clockMode;
+    ctx.clock_ticks = 0;
+    pll_reset(&ctx.pll, CLOCK_BANDWIDTH);
+    ctx.seq_bpm = (params->goalBPM > 0) ? params->goalBPM : 120;
+    ctx.seq_swing = 0;
+    ctx.seq_bpm_auto = (params->goalBPM <= 0);
+    ctx.tempo_match = params->detectBPM;
+    ctx.seq_record = false;
+    ctx.seq_pos = 0;
+    ctx.seq_was_running = false;
+    memset(ctx.recorded_step, 0xff, sizeof(ctx.recorded_step));
+    for (int v = 0; v < 128; v++){
+      ctx.velocity_gain[v] = (params->velocityCurve > 0) ?
+        powf(v / 127.0f, params->velocityCurve) : 1.0f;
+    }
+
+    if (params->realtime && !rt_lock_memory()){
+      fprintf(stderr, "Could not lock memory, check RLIMIT_MEMLOCK\n");
+    }
+    // previews are paged in as they are played, not locked all at once
+    if (params->realtime && ctx.use_pack){
+      pack_unlock(&ctx.pack);
+    }
+
+    // scan & watch the library, snippets show up as they are found
+    thread library(libraryThread, &ctx);
+    library.detach();
+    thread heads(headThread, &ctx);
+    heads.detach();
+
+    // voices render on the audio thread & workers on the cores after its own
+    if (!pool_start(&ctx.pool, params->threads, PERIOD_FRAMES * 1000000000LL / ctx.rate,
+          AUDIO_STACK_PREFAULT, params->realtime ? AUDIO_PRIORITY - 1 : 0)){
+      fprintf(stderr, "Could not pin render threads or set their priority\n");
+    }
+    // a slice per thread, each slice reads all voice outputs once more
+    ctx.mix_slices = 1;
+    while ((ctx.mix_slices * 2 <= ctx.pool.threads) &&
+        (PERIOD_FRAMES / (ctx.mix_slices * 2) >= MIX_MIN_SLICE_FRAMES)){
+      ctx.mix_slices *= 2;
+    }
 
-    // Setup the 'SoundTouch' object for processing the sound
-    setup(&ctx.soundTouch, params);
+    // start mixing
+    thread audio(audio_thread, &ctx);
+    if (params->realtime && !rt_set_fifo(audio.native_handle(), AUDIO_PRIORITY)){
+      fprintf(stderr, "Could not set realtime priority, check RLIMIT_RTPRIO\n");
+    }
+    if ((params->threads > 1) && !rt_pin_cpu(audio.native_handle(), 0)){
+      fprintf(stderr, "Could not pin the audio thread\n");
+    }
+    audio.detach();
 
     // Run controller 
     while (1) {
-      readMidi(&ctx);
+      if (waitMidi(&ctx)){
+        readMidi(&ctx);
+      }
     }
 
     // Close WAV file handles & dispose of the objects
     // TODO: cleanup
-    // delete inFile;
     delete params;
 
     fprintf(stderr, "Done!\n");